@@ -0,0 +1,318 @@
+// Batch runner, spreads a list of (ROM, input script, cycle budget) jobs over every core
+// Build: g++ -O2 -pthread chip8.cpp chip8log.cpp chip8rom.cpp batch.cpp -o chip8-batch
+//
+// Job list, one job per line, # starts a comment:
+//     <rom> <input script or -> <cycles>
+// With --archive, <rom> is the name of a ROM in the archive rather than a path. Build one with
+//     chip8-batch --pack roms.c8pk rom...
+// With --romdb, every ROM the database knows runs at its own speed and with its own quirks, the rest at
+// --clock. Compile one from a text list (format in chip8rom.h) with
+//     chip8-batch --build-romdb roms.txt roms.c8db
+// Input script, one key change per line, in cycle order:
+//     <cycle> <key 0-F> <1 pressed | 0 released>
+#include "chip8.h"
+#include "chip8rom.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct keyEvent
+{
+	unsigned long cycle;
+	unsigned char key;
+	unsigned char pressed;
+};
+
+struct batchJob
+{
+	std::string romPath;
+	std::string scriptPath;
+	unsigned long cycles;
+};
+
+struct batchResult
+{
+	bool loaded;
+	unsigned long cycles;
+	unsigned long long frameHash;
+	char registers[128];
+};
+
+// Emulated instructions per second for every job, sets how many instructions make a 60Hz timer tick
+static unsigned int clockSpeed = CHIP8_DEFAULT_CLOCK;
+
+// Every job's machine starts its random numbers from the same seed, so results don't depend on scheduling
+static unsigned long long randomSeed = CHIP8_DEFAULT_SEED;
+
+// Where job ROMs come from when given --archive. Mapped once and only read, every worker shares it
+static chip8RomArchive archive;
+static bool useArchive = false;
+
+// Per ROM speed and quirks when given --romdb, shared the same way
+static chip8RomDatabase romDatabase;
+
+// Each worker owns a deque of job indices, works from the back of its own and steals from the front of the others
+struct workQueue
+{
+	std::mutex lock;
+	std::deque<int> jobs;
+};
+
+static bool loadScript(const std::string & path, std::vector<keyEvent> & events) {
+	if (path == "-")
+		return true;
+
+	FILE * pFile = fopen(path.c_str(), "r");
+	if (pFile == NULL)
+		return false;
+
+	keyEvent event;
+	unsigned int key, pressed;
+	while (fscanf(pFile, "%lu %x %u", &event.cycle, &key, &pressed) == 3)
+	{
+		event.key = key & 0xF;
+		event.pressed = pressed != 0;
+		events.push_back(event);
+	}
+
+	fclose(pFile);
+	return true;
+}
+
+// Straight from the mapped file or archive into the machine, nothing copied or allocated on the way
+static bool loadRom(chip8 & machine, const std::string & name) {
+	if (useArchive)
+	{
+		int entry = archive.find(name);
+		return entry >= 0 && machine.loadProgram(archive.data(entry), archive.size(entry));
+	}
+
+	chip8RomFile rom;
+	return rom.open(name.c_str()) && machine.loadProgram(rom.data(), rom.size());
+}
+
+static void runJob(const batchJob & job, batchResult & result) {
+	// Far too big for a worker's stack, with room for XO-CHIP's 64 KB and a decoded copy of every address
+	std::unique_ptr<chip8> owned(new chip8());
+	chip8 & machine = *owned;
+	std::vector<keyEvent> events;
+
+	result.cycles = 0;
+	machine.setClockSpeed(clockSpeed);
+	machine.seedRandom(randomSeed);
+	result.loaded = loadRom(machine, job.romPath) && loadScript(job.scriptPath, events);
+	if (!result.loaded)
+		return;
+
+	chip8RomProfile profile;
+	if (romDatabase.find(machine.getRomHash(), profile))
+	{
+		if (profile.instructionsPerFrame > 0)
+			machine.setClockSpeed(profile.instructionsPerFrame * 60);
+		machine.setQuirks(profile.quirks);
+	}
+
+	// Run up to each key change, apply it, carry on
+	for (size_t i = 0; i < events.size() && events[i].cycle < job.cycles; ++i)
+	{
+		if (events[i].cycle > result.cycles)
+		{
+			machine.emulateCycles(events[i].cycle - result.cycles);
+			result.cycles = events[i].cycle;
+		}
+		machine.currentKey[events[i].key] = events[i].pressed;
+	}
+	machine.emulateCycles(job.cycles - result.cycles);
+	result.cycles = job.cycles;
+
+	result.frameHash = machine.frameHash();
+
+	// Print the register line into the result rather than straight to the output, so results come out in job order
+	FILE * registers = fmemopen(result.registers, sizeof(result.registers), "w");
+	if (registers)
+	{
+		machine.dumpRegisters(registers);
+		fclose(registers);
+	}
+}
+
+static bool popJob(std::vector<workQueue> & queues, int self, int & job) {
+	{
+		std::lock_guard<std::mutex> guard(queues[self].lock);
+		if (!queues[self].jobs.empty())
+		{
+			job = queues[self].jobs.back();
+			queues[self].jobs.pop_back();
+			return true;
+		}
+	}
+
+	for (size_t i = 1; i < queues.size(); ++i)
+	{
+		workQueue & victim = queues[(self + i) % queues.size()];
+		std::lock_guard<std::mutex> guard(victim.lock);
+		if (!victim.jobs.empty())
+		{
+			job = victim.jobs.front();
+			victim.jobs.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
+
+static void usage(const char * program) {
+	fprintf(stderr, "Usage: %s [--threads N] [--clock HZ] [--seed N] [--archive roms.c8pk] [--romdb roms.c8db] [--out results.txt] jobs.txt\n", program);
+	fprintf(stderr, "       %s --pack roms.c8pk rom...\n", program);
+	fprintf(stderr, "       %s --build-romdb roms.txt roms.c8db\n", program);
+}
+
+int main(int argc, char** argv) {
+	const char * jobsPath = NULL;
+	const char * outPath = NULL;
+	int threadCount = std::thread::hardware_concurrency();
+
+	if (argc > 2 && strcmp(argv[1], "--pack") == 0)
+	{
+		std::vector<std::string> paths(argv + 3, argv + argc);
+		if (!chip8RomArchive::write(argv[2], paths))
+			return 1;
+		fprintf(stderr, "Packed %zu ROMs into %s\n", paths.size(), argv[2]);
+		return 0;
+	}
+
+	if (argc == 4 && strcmp(argv[1], "--build-romdb") == 0)
+	{
+		chip8RomDatabase built;
+		if (!chip8RomDatabase::compile(argv[2], argv[3]) || !built.open(argv[3]))
+			return 1;
+		fprintf(stderr, "%d ROMs in %s\n", built.count(), argv[3]);
+		return 0;
+	}
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			threadCount = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--clock") == 0 && i + 1 < argc)
+			clockSpeed = strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+			randomSeed = strtoull(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+			outPath = argv[++i];
+		else if (strcmp(argv[i], "--archive") == 0 && i + 1 < argc)
+		{
+			if (!archive.open(argv[++i]))
+				return 1;
+			useArchive = true;
+		}
+		else if (strcmp(argv[i], "--romdb") == 0 && i + 1 < argc)
+		{
+			if (!romDatabase.open(argv[++i]))
+				return 1;
+		}
+		else if (argv[i][0] != '-')
+			jobsPath = argv[i];
+		else
+		{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (jobsPath == NULL)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	if (threadCount < 1)
+		threadCount = 1;
+
+	FILE * jobsFile = fopen(jobsPath, "r");
+	if (jobsFile == NULL)
+	{
+		fprintf(stderr, "Can't open job list %s\n", jobsPath);
+		return 1;
+	}
+
+	std::vector<batchJob> jobs;
+	char line[4096];
+	while (fgets(line, sizeof(line), jobsFile))
+	{
+		char rom[2048], script[2048];
+		unsigned long cycles;
+		if (line[0] == '#' || sscanf(line, "%2047s %2047s %lu", rom, script, &cycles) != 3)
+			continue;
+
+		batchJob job;
+		job.romPath = rom;
+		job.scriptPath = script;
+		job.cycles = cycles;
+		jobs.push_back(job);
+	}
+	fclose(jobsFile);
+
+	// Deal the jobs out round robin, stealing evens out whatever the cycle budgets turn out to cost
+	std::vector<workQueue> queues(threadCount);
+	for (size_t i = 0; i < jobs.size(); ++i)
+		queues[i % threadCount].jobs.push_back(i);
+
+	std::vector<batchResult> results(jobs.size());
+	std::atomic<unsigned long long> totalCycles(0);
+
+	auto start = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threadCount; ++t)
+	{
+		workers.push_back(std::thread([&, t]() {
+			unsigned long long cycles = 0;
+			int job;
+			while (popJob(queues, t, job))
+			{
+				runJob(jobs[job], results[job]);
+				cycles += results[job].cycles;
+			}
+			totalCycles += cycles;
+		}));
+	}
+	for (size_t t = 0; t < workers.size(); ++t)
+		workers[t].join();
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	FILE * out = outPath ? fopen(outPath, "w") : stdout;
+	if (out == NULL)
+	{
+		fprintf(stderr, "Can't open %s\n", outPath);
+		return 1;
+	}
+
+	for (size_t i = 0; i < jobs.size(); ++i)
+	{
+		const batchResult & result = results[i];
+		if (!result.loaded)
+			fprintf(out, "%s FAILED\n", jobs[i].romPath.c_str());
+		else
+			fprintf(out, "%s cycles=%lu hash=%016llx %s\n", jobs[i].romPath.c_str(), result.cycles, result.frameHash, result.registers);
+	}
+	if (out != stdout)
+		fclose(out);
+
+	fprintf(stderr, "%zu jobs, %llu cycles on %d threads in %.3f s (%.0f instructions/s)\n",
+		jobs.size(), totalCycles.load(), threadCount, seconds, seconds > 0 ? totalCycles.load() / seconds : 0.0);
+
+	// Every machine has gone, so everything they logged has been written or counted by now
+	chip8Logger::counters log = chip8Logger::getCounters();
+	if (log.suppressed > 0 || log.dropped > 0)
+		fprintf(stderr, "Log: %llu events written, %llu over the rate limit, %llu dropped\n", log.written, log.suppressed, log.dropped);
+	return 0;
+}
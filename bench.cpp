@@ -0,0 +1,856 @@
+// Benchmarks, to measure the interpreter and catch regressions between builds
+// Build: g++ -O2 -pthread chip8.cpp chip8log.cpp chip8rom.cpp chip8movie.cpp chip8rewind.cpp chip8lockstep.cpp bench.cpp -o chip8-bench
+// (-O3 -march=native for the lockstep engine's loops to vectorise)
+//
+// Four sets, every result reported as instructions/s, ns per instruction and 60Hz frames/s:
+//     micro/<family>      one opcode family repeated in a tight loop, measures that family's handlers
+//     synthetic/<family>  a generated ROM, mostly that family with random operands and the rest mixed in
+//     macro/<rom>         whole ROMs, either run for a fixed number of cycles from a fixed seed, or an input
+//                         movie replayed with its own seed and key presses (its hash checks are reported too)
+//     rewind/<rom>        a minute of a ROM run a frame at a time with a state recorded into a rewind ring every
+//                         frame, the cost of the window's rewind. Stepping back through the ring afterwards has to give
+//                         every recorded state back exactly, any that don't are reported as mismatches
+//
+// With --lockstep N the micro, synthetic and --rom benchmarks run instead as N copies of the ROM, each seeded
+// differently, once as N chip8 runs one after another (<name>/scalar) and once side by side in chip8Lockstep's
+// N lanes (<name>/lockstep), splitting --cycles between them. Every lane has to end with the same registers
+// and screen as its scalar run, any that don't are reported as mismatches. Lanes that stopped on SUPER-CHIP
+// instructions, which only chip8 runs, are counted and left out.
+//
+// --verify-jit (in a -DCHIP8_JIT=1 build with chip8jit.cpp) checks the JIT instead of timing anything. The micro,
+// synthetic and --rom benchmarks, and a few random programs that write over their own code, each run under
+// every set of quirks on two machines, one with the JIT and one interpreting, with random key presses between
+// random length stretches. Their saved states have to match after every stretch, each set of quirks where they
+// don't is reported as a divergence (jit/<name>).
+//
+// Each benchmark runs --repeat times from a fresh machine and the best run is reported. The hash is the
+// screen hash at the end, it should only change between builds when emulation itself did. Any mismatch
+// makes the exit status 2.
+#include "chip8.h"
+#include "chip8lockstep.h"
+#include "chip8movie.h"
+#include "chip8rewind.h"
+#include "chip8rom.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define BENCH_SEED 1
+
+chip8 programChip;
+chip8 verifyChip;
+
+struct benchResult
+{
+	std::string name;
+	unsigned long long cycles;
+	unsigned int clock;		// Clock it ran at, a movie brings its own
+	double seconds;			// Best run
+	double medianSeconds;
+	unsigned long long hash;
+	long mismatches;		// Movie frames whose hash didn't match, -1 when there's no movie
+};
+
+static unsigned long cycles = 10000000;
+static unsigned long romCycles = 10000000;
+static int repeat = 5;
+static const char * filter = NULL;
+static int lockstepLanes = 0;
+static bool verifyJitMode = false;
+static long jitDivergences = 0;
+
+// xorshift32, so generated ROMs come out the same whatever rand() the host has
+static uint32_t genState;
+
+static uint32_t genNext() {
+	genState ^= genState << 13;
+	genState ^= genState >> 17;
+	genState ^= genState << 5;
+	return genState;
+}
+
+static unsigned int genRange(unsigned int n) {
+	return genNext() % n;
+}
+
+static void loadProgram(const std::vector<unsigned char> & program) {
+	programChip.loadProgram(program.data(), program.size());
+}
+
+static std::vector<unsigned char> toBytes(const std::vector<unsigned short> & program) {
+	std::vector<unsigned char> bytes;
+	for (size_t i = 0; i < program.size(); ++i)
+	{
+		bytes.push_back(program[i] >> 8);
+		bytes.push_back(program[i] & 0xFF);
+	}
+	return bytes;
+}
+
+// The whole file, refused if it's more than chip8::loadProgram takes rather than timed cut short
+static bool readRom(const char * path, std::vector<unsigned char> & rom) {
+	chip8RomFile file;
+	if (!file.open(path))
+	{
+		fprintf(stderr, "File error: %s\n", path);
+		return false;
+	}
+	if (file.size() > CHIP8_MEMORY_SIZE - 0x200)
+	{
+		fprintf(stderr, "ROM too big for memory: %s\n", path);
+		return false;
+	}
+
+	rom.assign(file.data(), file.data() + file.size());
+	return true;
+}
+
+// Microbenchmarks: 64 instructions of one family then a jump back to the top
+
+static void microAlu(std::vector<unsigned short> & p) {
+	static const unsigned short ops[] = { 0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0xE };
+	for (int i = 0; i < 64; ++i)
+	{
+		int x = i % 16, y = (i + 3) % 16;
+		if (i % 10 == 9)
+			p.push_back(0x7000 | x << 8 | (i * 37 & 0xFF));
+		else
+			p.push_back(0x8000 | x << 8 | y << 4 | ops[i % 9]);
+	}
+}
+
+static void microDraw(std::vector<unsigned short> & p) {
+	p.push_back(0xA000);
+	for (int i = 0; i < 16; ++i)
+	{
+		p.push_back(0xD015);
+		p.push_back(0x7005);
+		p.push_back(0xD01F);
+		p.push_back(0x7103);
+	}
+}
+
+static void microMemory(std::vector<unsigned short> & p) {
+	for (int i = 0; i < 16; ++i)
+	{
+		p.push_back(0xA300);
+		p.push_back(0xF333);
+		p.push_back(0xF755);
+		p.push_back(0xF765);
+	}
+}
+
+// Taken and untaken skips, a call and return, and a jump to the next instruction
+static void microFlow(std::vector<unsigned short> & p, unsigned short subroutine) {
+	for (int i = 0; i < 8; ++i)
+	{
+		p.push_back(0x3000);
+		p.push_back(0x7105);
+		p.push_back(0x4000);
+		p.push_back(0x5010);
+		p.push_back(0x7105);
+		p.push_back(0x9010);
+		p.push_back(0x2000 | subroutine);
+		p.push_back(0x1000 | (0x200 + (p.size() + 1) * 2));
+	}
+}
+
+static void microTimers(std::vector<unsigned short> & p) {
+	for (int i = 0; i < 8; ++i)
+	{
+		p.push_back(0xC1FF);
+		p.push_back(0xF115);
+		p.push_back(0xF207);
+		p.push_back(0xF018);	// V0 stays 0, so no BEEP
+		p.push_back(0xF21E);
+		p.push_back(0xF129);
+		p.push_back(0x6305);
+		p.push_back(0xF31E);
+	}
+}
+
+enum family { FAMILY_ALU, FAMILY_DRAW, FAMILY_MEMORY, FAMILY_FLOW, FAMILY_TIMERS, FAMILY_COUNT };
+static const char * familyNames[FAMILY_COUNT] = { "alu", "draw", "memory", "flow", "timers" };
+
+static void buildMicro(int f, std::vector<unsigned short> & p) {
+	// The flow subroutine goes right after the loop: 64 instructions and the jump back
+	unsigned short subroutine = 0x200 + 65 * 2;
+	switch (f)
+	{
+		case FAMILY_ALU: microAlu(p); break;
+		case FAMILY_DRAW: microDraw(p); break;
+		case FAMILY_MEMORY: microMemory(p); break;
+		case FAMILY_FLOW: microFlow(p, subroutine); break;
+		case FAMILY_TIMERS: microTimers(p); break;
+	}
+	p.push_back(0x1200);
+	p.push_back(0x00EE);
+}
+
+// Synthetic ROMs: 1500 instructions from 0x200, subroutines after them and data from 0xE00. Instructions
+// come in units that a skip or jump can never split, so every write lands in the data area and the
+// program never modifies itself. 3 units in 4 come from the family under test
+#define SYNTH_LENGTH 1500
+#define SYNTH_SUBROUTINES 8
+#define SYNTH_DATA 0xE00
+
+static void synthUnit(int f, std::vector<unsigned short> & p, unsigned short subroutines) {
+	static const unsigned short aluOps[] = { 0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0xE };
+	unsigned short x = genRange(16), y = genRange(16);
+
+	switch (f)
+	{
+		case FAMILY_ALU:
+			if (genRange(4) == 0)
+				p.push_back((genRange(2) ? 0x6000 : 0x7000) | x << 8 | genRange(256));
+			else
+			{
+				p.push_back(0x8000 | x << 8 | y << 4 | aluOps[genRange(9)]);
+
+				// With X as F, XOR whatever the op left in VF into another register before a later flag overwrites it
+				if (x == 0xF)
+					p.push_back(0x80F3 | genRange(15) << 8);
+			}
+			break;
+		case FAMILY_DRAW:
+			if (genRange(4) == 0)
+				p.push_back(0xA000 | genRange(16) * 5);
+			p.push_back(0xD000 | x << 8 | y << 4 | (1 + genRange(15)));
+			break;
+		case FAMILY_MEMORY:
+		{
+			static const unsigned short memoryOps[] = { 0x33, 0x55, 0x65 };
+			p.push_back(0xA000 | (SYNTH_DATA + genRange(0xF0)));
+			p.push_back(0xF000 | x << 8 | memoryOps[genRange(3)]);
+			break;
+		}
+		case FAMILY_FLOW:
+			switch (genRange(4))
+			{
+				case 0:
+				{
+					// Skip over one ALU op
+					static const unsigned short skips[] = { 0x3000, 0x4000, 0x5000, 0x9000 };
+					unsigned short skip = skips[genRange(4)];
+					p.push_back(skip | x << 8 | (skip == 0x3000 || skip == 0x4000 ? genRange(4) : y << 4));
+					p.push_back(0x7000 | genRange(16) << 8 | genRange(256));
+					break;
+				}
+				case 1:
+					p.push_back(0x2000 | (subroutines + genRange(SYNTH_SUBROUTINES) * 8));
+					break;
+				default:
+					// Forward past a filler op, a jump target is always the start of a unit
+					p.push_back(0x1000 | (0x200 + (p.size() + 2) * 2));
+					p.push_back(0x8000 | x << 8 | y << 4 | aluOps[genRange(9)]);
+					break;
+			}
+			break;
+		case FAMILY_TIMERS:
+		{
+			static const unsigned short timerOps[] = { 0x07, 0x15, 0x1E, 0x29 };
+			if (genRange(4) == 0)
+				p.push_back(0xC000 | x << 8 | genRange(256));
+			else
+				p.push_back(0xF000 | x << 8 | timerOps[genRange(4)]);
+			break;
+		}
+	}
+}
+
+static void buildSynthetic(int f, std::vector<unsigned short> & p) {
+	genState = 0x9E3779B9u ^ (f + 1);
+
+	// Every unit is at most 2 instructions, stop short enough to leave room for the jump back
+	unsigned short subroutines = 0x200 + SYNTH_LENGTH * 2;
+	while (p.size() < SYNTH_LENGTH - 2)
+		synthUnit(genRange(4) == 0 ? (int)genRange(FAMILY_COUNT) : f, p, subroutines);
+	while (p.size() < SYNTH_LENGTH - 1)
+		p.push_back(0x8000);
+	p.push_back(0x1200);
+
+	// Each subroutine is 3 ALU ops and a return, 8 bytes
+	for (int i = 0; i < SYNTH_SUBROUTINES; ++i)
+	{
+		for (int j = 0; j < 3; ++j)
+			p.push_back(0x8000 | genRange(16) << 8 | genRange(16) << 4 | (genRange(2) ? 0x4 : 0x3));
+		p.push_back(0x00EE);
+	}
+}
+
+// JIT check programs: synthetic units, with stores over the program (which may already be translated) and
+// opcodes picked at random mixed in. The random ones are anything but jumps, calls and returns, so most runs
+// keep going rather than wandering off into memory
+#define VERIFY_PROGRAMS 8
+#define VERIFY_LENGTH 1024
+
+static unsigned short randomOpcode() {
+	for (;;)
+	{
+		unsigned short opcode = genNext() & 0xFFFF;
+		unsigned short top = opcode >> 12;
+		if (top == 0x1 || top == 0x2 || top == 0xB)
+			continue;
+		if (top == 0x0 && opcode != 0x00E0 && (opcode & 0xFFF0) != 0x00C0 && opcode < 0x00FB)
+			continue;
+		if (opcode == 0x00FD)
+			continue;
+		return opcode;
+	}
+}
+
+static void buildVerify(int n, std::vector<unsigned short> & p) {
+	genState = 0x85EBCA6Bu ^ (n + 1);
+
+	unsigned short subroutines = 0x200 + VERIFY_LENGTH * 2;
+	while (p.size() < VERIFY_LENGTH - 2)
+	{
+		switch (genRange(8))
+		{
+			case 0:
+				p.push_back(0xA000 | (0x200 + genRange(VERIFY_LENGTH) * 2));
+				p.push_back(0xF055 | genRange(4) << 8);
+				break;
+			case 1:
+				p.push_back(randomOpcode());
+				break;
+			default:
+				synthUnit(genRange(FAMILY_COUNT), p, subroutines);
+				break;
+		}
+	}
+	while (p.size() < VERIFY_LENGTH - 1)
+		p.push_back(0x8000);
+	p.push_back(0x1200);
+
+	for (int i = 0; i < SYNTH_SUBROUTINES; ++i)
+	{
+		for (int j = 0; j < 3; ++j)
+			p.push_back(0x8000 | genRange(16) << 8 | genRange(16) << 4 | (genRange(2) ? 0x4 : 0x3));
+		p.push_back(0x00EE);
+	}
+}
+
+// Longest stretch run between two comparisons
+#define VERIFY_CHUNK 5000
+
+// Rewind ROMs. memory is the synthetic memory ROM. xochip loops writing two registers to the top of 64 KB
+// and drawing, so its states are the full size and the bytes that change sit at both ends of them
+static void buildRewindXoChip(std::vector<unsigned short> & p) {
+	p.push_back(0xF000);	// I = FFF0
+	p.push_back(0xFFF0);
+	p.push_back(0x7001);
+	p.push_back(0x7103);
+	p.push_back(0xF155);
+	p.push_back(0xF029);
+	p.push_back(0xD125);
+	p.push_back(0x1200);
+}
+
+// Frames in a rewind benchmark, a minute of play whatever --cycles says
+#define REWIND_FRAMES 3600
+
+// Frames recorded and then stepped back through by checkRewind, each kept whole to compare against
+#define REWIND_CHECK_FRAMES 256
+
+static bool sameState(const chip8Snapshot & a, const chip8Snapshot & b) {
+	return a.stateSize == b.stateSize && memcmp(&a.state, &b.state, a.stateSize) == 0;
+}
+
+// Records a state every frame, then steps back through all of them and counts the ones that don't come back
+// exactly. Starts with a pair of states that differ only in their first and last bytes, the longest unchanged
+// run a delta can have at the machine's state size
+static long checkRewind(unsigned int clock) {
+	chip8Rewind rewind(64 * 1024 * 1024);
+	std::vector<chip8Snapshot> recorded(REWIND_CHECK_FRAMES);
+	chip8Snapshot restored;
+	long mismatches = 0;
+
+	programChip.saveState(recorded[0]);
+	recorded[1] = recorded[0];
+	((unsigned char *)&recorded[1].state)[0] ^= 0xFF;
+	((unsigned char *)&recorded[1].state)[recorded[1].stateSize - 1] ^= 0xFF;
+	rewind.record(recorded[0]);
+	rewind.record(recorded[1]);
+	if (!rewind.stepBack(restored) || !sameState(restored, recorded[0]))
+		++mismatches;
+	rewind.clear();
+
+	for (int i = 0; i < REWIND_CHECK_FRAMES; ++i)
+	{
+		programChip.emulateCycles(clock / 60);
+		programChip.saveState(recorded[i]);
+		rewind.record(recorded[i]);
+	}
+	for (int i = REWIND_CHECK_FRAMES - 2; i >= 0; --i)
+	{
+		if (!rewind.stepBack(restored) || !sameState(restored, recorded[i]))
+			++mismatches;
+	}
+	return mismatches;
+}
+
+static bool selected(const std::string & name) {
+	return filter == NULL || name.find(filter) != std::string::npos;
+}
+
+// Runs a benchmark repeat times, prepare resets the machine before each one and run does the timed part
+template <typename Prepare, typename Run>
+static benchResult measure(const std::string & name, Prepare prepare, Run run) {
+	benchResult result;
+	result.name = name;
+	result.mismatches = -1;
+
+	std::vector<double> times;
+	for (int i = 0; i < repeat; ++i)
+	{
+		prepare();
+		auto start = std::chrono::steady_clock::now();
+		result.cycles = run(result.mismatches);
+		times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+		result.hash = programChip.frameHash();
+		result.clock = programChip.getClockSpeed();
+	}
+
+	std::sort(times.begin(), times.end());
+	result.seconds = times[0];
+	result.medianSeconds = times[times.size() / 2];
+	return result;
+}
+
+static double instructionsPerSecond(const benchResult & r) {
+	return r.seconds > 0 ? r.cycles / r.seconds : 0;
+}
+
+static double nsPerInstruction(const benchResult & r) {
+	return r.cycles > 0 ? r.seconds * 1e9 / r.cycles : 0;
+}
+
+static double framesPerSecond(const benchResult & r) {
+	return r.seconds > 0 ? (double)r.cycles * 60 / r.clock / r.seconds : 0;
+}
+
+static void printResult(const benchResult & r) {
+	chip8Logger::flush();
+	printf("%-24s %12llu %14.0f %10.3f %12.0f  %016llx", r.name.c_str(), r.cycles, instructionsPerSecond(r), nsPerInstruction(r), framesPerSecond(r), r.hash);
+	if (r.mismatches > 0)
+		printf("  %ld mismatched frames", r.mismatches);
+	printf("\n");
+	fflush(stdout);
+}
+
+// dumpRegisters output as a string, for comparing a lockstep lane with a chip8
+template <typename Dump>
+static std::string registerLine(Dump dump) {
+	char line[128] = "";
+	FILE * out = fmemopen(line, sizeof(line), "w");
+	if (out)
+	{
+		dump(out);
+		fclose(out);
+	}
+	return line;
+}
+
+// The same ROM as lanes chip8 runs one after another and as one chip8Lockstep, each copy with its own seed.
+// The scalar runs are the reference every lane is checked against
+static void measureLockstep(const std::string & name, const std::vector<unsigned char> & image, std::vector<benchResult> & results) {
+	// Lanes only have 4 KB, anything bigger needs XO-CHIP's memory
+	if (image.size() > 4096 - 0x200)
+	{
+		fprintf(stderr, "%s: too big for a lockstep lane, skipped\n", name.c_str());
+		return;
+	}
+
+	unsigned long perLane = std::max(1ul, cycles / lockstepLanes);
+	std::vector<std::string> registers(lockstepLanes);
+	std::vector<unsigned long long> hashes(lockstepLanes);
+
+	results.push_back(measure(name + "/scalar",
+		[&]() {},
+		[&](long &) {
+			for (int l = 0; l < lockstepLanes; ++l)
+			{
+				programChip.seedRandom(BENCH_SEED + l);
+				loadProgram(image);
+				programChip.emulateCycles(perLane);
+				hashes[l] = programChip.frameHash();
+				registers[l] = registerLine([&](FILE * out) { programChip.dumpRegisters(out); });
+			}
+			return (unsigned long long)perLane * lockstepLanes;
+		}));
+	programChip.seedRandom(BENCH_SEED);
+	printResult(results.back());
+
+	chip8Lockstep lockstep(lockstepLanes);
+	lockstep.setClockSpeed(programChip.getClockSpeed());
+	for (int l = 0; l < lockstepLanes; ++l)
+		lockstep.seedRandom(l, BENCH_SEED + l);
+
+	results.push_back(measure(name + "/lockstep",
+		[&]() { lockstep.loadProgram(image.data(), image.size()); },
+		[&](long &) { lockstep.emulateCycles(perLane); return (unsigned long long)perLane * lockstepLanes; }));
+
+	benchResult & result = results.back();
+	result.hash = lockstep.frameHash(lockstepLanes - 1);
+	result.mismatches = 0;
+	int superChip = 0;
+	for (int l = 0; l < lockstepLanes; ++l)
+	{
+		// The lockstep engine doesn't run SUPER-CHIP code, chip8 does, so there's nothing to compare
+		if (lockstep.stalledOnSuperChip(l))
+		{
+			++superChip;
+			continue;
+		}
+
+		std::string laneRegisters = registerLine([&](FILE * out) { lockstep.dumpRegisters(l, out); });
+		if (lockstep.frameHash(l) == hashes[l] && laneRegisters == registers[l])
+			continue;
+
+		if (result.mismatches++ == 0)
+			fprintf(stderr, "%s lane %d: %s %016llx, chip8 has %s %016llx\n", name.c_str(), l,
+				laneRegisters.c_str(), lockstep.frameHash(l), registers[l].c_str(), hashes[l]);
+	}
+	if (superChip > 0)
+		fprintf(stderr, "%s: %d lanes stopped on SUPER-CHIP instructions, not compared\n", name.c_str(), superChip);
+	printResult(result);
+}
+
+// Runs image under every set of quirks on programChip with the JIT and verifyChip without, comparing their
+// states after every stretch. Each set of quirks that diverges counts once, with its first difference on stderr
+static void verifyJit(const std::string & name, const std::vector<unsigned char> & image) {
+	static chip8Snapshot jitState, interpretedState;
+	unsigned long perQuirks = std::max(1ul, cycles / (CHIP8_QUIRK_ALL + 1));
+	long diverged = 0;
+
+	programChip.setJitEnabled(true);
+	verifyChip.setJitEnabled(false);
+	verifyChip.setClockSpeed(programChip.getClockSpeed());
+	verifyChip.seedRandom(BENCH_SEED);
+	for (unsigned int quirks = 0; quirks <= CHIP8_QUIRK_ALL; ++quirks)
+	{
+		programChip.setQuirks(quirks);
+		verifyChip.setQuirks(quirks);
+		if (!programChip.loadProgram(image.data(), image.size()) || !verifyChip.loadProgram(image.data(), image.size()))
+			return;
+
+		genState = 0x27D4EB2Fu ^ quirks;
+		for (unsigned long ran = 0; ran < perQuirks; )
+		{
+			unsigned long chunk = std::min(perQuirks - ran, 1ul + genRange(VERIFY_CHUNK));
+			if (genRange(4) == 0)
+			{
+				int key = genRange(16);
+				programChip.currentKey[key] ^= 1;
+				verifyChip.currentKey[key] ^= 1;
+			}
+			programChip.emulateCycles(chunk);
+			verifyChip.emulateCycles(chunk);
+			ran += chunk;
+
+			programChip.saveState(jitState);
+			verifyChip.saveState(interpretedState);
+			if (sameState(jitState, interpretedState))
+				continue;
+
+			fprintf(stderr, "%s quirks %02x after %lu: jit %s, interpreter %s\n", name.c_str(), quirks, ran,
+				registerLine([&](FILE * out) { programChip.dumpRegisters(out); }).c_str(),
+				registerLine([&](FILE * out) { verifyChip.dumpRegisters(out); }).c_str());
+			++diverged;
+			break;
+		}
+	}
+	programChip.setQuirks(0);
+
+	printf("%-24s %12lu %8u quirk sets", ("jit/" + name).c_str(), perQuirks * (CHIP8_QUIRK_ALL + 1), CHIP8_QUIRK_ALL + 1);
+	if (diverged > 0)
+		printf("  %ld diverged", diverged);
+	printf("\n");
+	fflush(stdout);
+	jitDivergences += diverged;
+}
+
+static void writeJsonString(FILE * out, const std::string & s) {
+	fputc('"', out);
+	for (size_t i = 0; i < s.size(); ++i)
+	{
+		if (s[i] == '"' || s[i] == '\\')
+			fputc('\\', out);
+		if ((unsigned char)s[i] >= 0x20)
+			fputc(s[i], out);
+	}
+	fputc('"', out);
+}
+
+// One benchmark to a line, so two runs diff cleanly
+static bool writeJson(const char * path, const std::vector<benchResult> & results) {
+	FILE * out = fopen(path, "w");
+	if (out == NULL)
+	{
+		fputs("File error", stderr);
+		return false;
+	}
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"build\": {\"dispatch\": %d, \"jit\": %d, \"compiler\": ", CHIP8_DISPATCH, CHIP8_JIT);
+	writeJsonString(out, __VERSION__);
+	fprintf(out, "},\n");
+	fprintf(out, "  \"repeat\": %d,\n", repeat);
+	fprintf(out, "  \"benchmarks\": [\n");
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const benchResult & r = results[i];
+		fprintf(out, "    {\"name\": ");
+		writeJsonString(out, r.name);
+		fprintf(out, ", \"cycles\": %llu, \"clock\": %u, \"seconds\": %.6f, \"median_seconds\": %.6f, \"instructions_per_second\": %.0f, \"ns_per_instruction\": %.4f, \"frames_per_second\": %.0f, \"hash\": \"%016llx\"",
+			r.cycles, r.clock, r.seconds, r.medianSeconds, instructionsPerSecond(r), nsPerInstruction(r), framesPerSecond(r), r.hash);
+		if (r.mismatches >= 0)
+			fprintf(out, ", \"mismatches\": %ld", r.mismatches);
+		fprintf(out, "}%s\n", i + 1 < results.size() ? "," : "");
+	}
+	fprintf(out, "  ]\n}\n");
+
+	bool written = !ferror(out);
+	fclose(out);
+	return written;
+}
+
+static std::string baseName(const char * path) {
+	const char * slash = strrchr(path, '/');
+	return slash ? slash + 1 : path;
+}
+
+static void usage(const char * program) {
+	fprintf(stderr, "Usage: %s [options]\n", program);
+	fprintf(stderr, "  --clock HZ       Emulated instructions per second, sets the frames/s figure and timer rate (default %d)\n", CHIP8_DEFAULT_CLOCK);
+	fprintf(stderr, "  --cycles N       Instructions per micro and synthetic run (default 10000000)\n");
+	fprintf(stderr, "  --repeat N       Runs of each benchmark, the best is reported (default 5)\n");
+	fprintf(stderr, "  --rom FILE       Add a macro benchmark running FILE from a fixed seed, may be given more than once\n");
+	fprintf(stderr, "  --rom-cycles N   Instructions per --rom run (default 10000000)\n");
+	fprintf(stderr, "  --movie FILE     Add a macro benchmark replaying an input movie, may be given more than once\n");
+	fprintf(stderr, "  --filter TEXT    Only run benchmarks whose name contains TEXT\n");
+	fprintf(stderr, "  --json FILE      Also write the results to FILE as JSON\n");
+	fprintf(stderr, "  --lockstep N     Run micro, synthetic and --rom benchmarks as N seeds side by side in the lockstep engine\n");
+	fprintf(stderr, "                   and as N chip8 runs, checking every lane against its run. Skips movies and rewind\n");
+	fprintf(stderr, "  --verify-jit     Check the JIT against the interpreter under every set of quirks instead of timing\n");
+}
+
+int main(int argc, char** argv) {
+	const char * jsonPath = NULL;
+	std::vector<const char *> roms;
+	std::vector<const char *> movies;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--clock") == 0 && i + 1 < argc)
+			programChip.setClockSpeed(strtoul(argv[++i], NULL, 10));
+		else if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc)
+			cycles = strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+			repeat = std::max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "--rom") == 0 && i + 1 < argc)
+			roms.push_back(argv[++i]);
+		else if (strcmp(argv[i], "--rom-cycles") == 0 && i + 1 < argc)
+			romCycles = strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--movie") == 0 && i + 1 < argc)
+			movies.push_back(argv[++i]);
+		else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+			filter = argv[++i];
+		else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+			jsonPath = argv[++i];
+		else if (strcmp(argv[i], "--lockstep") == 0 && i + 1 < argc)
+			lockstepLanes = std::max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "--verify-jit") == 0)
+			verifyJitMode = true;
+		else
+		{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+#if !CHIP8_JIT || CHIP8_PROFILE
+	if (verifyJitMode)
+	{
+		fprintf(stderr, "--verify-jit needs a build with -DCHIP8_JIT=1 and chip8jit.cpp\n");
+		return 1;
+	}
+#endif
+
+	// Everything is read up front so a missing file stops us before any timing starts
+	std::vector<std::vector<unsigned char> > romImages(roms.size());
+	for (size_t i = 0; i < roms.size(); ++i)
+	{
+		if (!readRom(roms[i], romImages[i]))
+			return 1;
+	}
+
+	std::vector<chip8Movie> loadedMovies(movies.size());
+	std::vector<std::vector<unsigned char> > movieImages(movies.size());
+	for (size_t i = 0; i < movies.size(); ++i)
+	{
+		if (!loadedMovies[i].load(movies[i]) || !readRom(loadedMovies[i].romPath.c_str(), movieImages[i]))
+			return 1;
+	}
+
+	if (verifyJitMode)
+	{
+		std::vector<std::pair<std::string, std::vector<unsigned char> > > programs;
+		for (int f = 0; f < FAMILY_COUNT; ++f)
+		{
+			std::vector<unsigned short> micro, synthetic;
+			buildMicro(f, micro);
+			buildSynthetic(f, synthetic);
+			programs.push_back(std::make_pair(std::string("micro/") + familyNames[f], toBytes(micro)));
+			programs.push_back(std::make_pair(std::string("synthetic/") + familyNames[f], toBytes(synthetic)));
+		}
+		for (int v = 0; v < VERIFY_PROGRAMS; ++v)
+		{
+			std::vector<unsigned short> program;
+			buildVerify(v, program);
+			programs.push_back(std::make_pair("verify/" + std::to_string(v), toBytes(program)));
+		}
+		for (size_t i = 0; i < roms.size(); ++i)
+			programs.push_back(std::make_pair("macro/" + baseName(roms[i]), romImages[i]));
+
+		printf("%-24s %12s\n", "benchmark", "cycles");
+		for (size_t i = 0; i < programs.size(); ++i)
+		{
+			if (selected(programs[i].first))
+				verifyJit(programs[i].first, programs[i].second);
+		}
+		return jitDivergences > 0 ? 2 : 0;
+	}
+
+	printf("%-24s %12s %14s %10s %12s  %s\n", "benchmark", "cycles", "instructions/s", "ns/instr", "frames/s", "hash");
+
+	// initialize restarts CXNN's random numbers from this, so every run of a benchmark sees the same ones
+	programChip.seedRandom(BENCH_SEED);
+
+	std::vector<benchResult> results;
+	unsigned int clock = programChip.getClockSpeed();
+
+	for (int f = 0; f < FAMILY_COUNT; ++f)
+	{
+		std::vector<unsigned short> program;
+		std::string name = std::string("micro/") + familyNames[f];
+		if (!selected(name))
+			continue;
+
+		buildMicro(f, program);
+		std::vector<unsigned char> image = toBytes(program);
+		if (lockstepLanes > 0)
+		{
+			measureLockstep(name, image, results);
+			continue;
+		}
+		results.push_back(measure(name,
+			[&]() { loadProgram(image); },
+			[&](long &) { programChip.emulateCycles(cycles); return (unsigned long long)cycles; }));
+		printResult(results.back());
+	}
+
+	for (int f = 0; f < FAMILY_COUNT; ++f)
+	{
+		std::vector<unsigned short> program;
+		std::string name = std::string("synthetic/") + familyNames[f];
+		if (!selected(name))
+			continue;
+
+		buildSynthetic(f, program);
+		std::vector<unsigned char> image = toBytes(program);
+		if (lockstepLanes > 0)
+		{
+			measureLockstep(name, image, results);
+			continue;
+		}
+		results.push_back(measure(name,
+			[&]() { loadProgram(image); },
+			[&](long &) { programChip.emulateCycles(cycles); return (unsigned long long)cycles; }));
+		printResult(results.back());
+	}
+
+	for (size_t i = 0; i < roms.size(); ++i)
+	{
+		std::string name = "macro/" + baseName(roms[i]);
+		if (!selected(name))
+			continue;
+		if (lockstepLanes > 0)
+		{
+			measureLockstep(name, romImages[i], results);
+			continue;
+		}
+
+		results.push_back(measure(name,
+			[&]() { loadProgram(romImages[i]); },
+			[&](long &) { programChip.emulateCycles(romCycles); return (unsigned long long)romCycles; }));
+		printResult(results.back());
+	}
+
+	for (size_t i = 0; i < loadedMovies.size(); ++i)
+	{
+		const chip8Movie & movie = loadedMovies[i];
+		std::string name = "macro/" + baseName(movies[i]);
+		if (!selected(name) || lockstepLanes > 0)
+			continue;
+
+		// replay seeds the random numbers and sets the clock the movie was recorded at
+		results.push_back(measure(name,
+			[&]() { loadProgram(movieImages[i]); },
+			[&](long & mismatches) { mismatches = movie.replay(programChip, NULL); return movie.length; }));
+		programChip.setClockSpeed(clock);
+		programChip.seedRandom(BENCH_SEED);
+		printResult(results.back());
+	}
+
+	// The rewind ring lives as long as a run, like the window's, so each run pays for filling it from empty
+	std::unique_ptr<chip8Rewind> rewind;
+	chip8Snapshot rewindState;
+	for (int r = 0; r < 2; ++r)
+	{
+		std::vector<unsigned short> program;
+		std::string name = r == 0 ? "rewind/memory" : "rewind/xochip";
+		if (!selected(name) || lockstepLanes > 0)
+			continue;
+
+		if (r == 0)
+			buildSynthetic(FAMILY_MEMORY, program);
+		else
+			buildRewindXoChip(program);
+		std::vector<unsigned char> image = toBytes(program);
+		programChip.setQuirks(r == 0 ? 0 : CHIP8_QUIRK_XO_CHIP);
+
+		unsigned long perFrame = clock / 60;
+		results.push_back(measure(name,
+			[&]() { rewind.reset(new chip8Rewind(8 * 1024 * 1024)); loadProgram(image); },
+			[&](long &) {
+				for (int f = 0; f < REWIND_FRAMES; ++f)
+				{
+					programChip.emulateCycles(perFrame);
+					programChip.saveState(rewindState);
+					rewind->record(rewindState);
+				}
+				return (unsigned long long)REWIND_FRAMES * perFrame;
+			}));
+
+		loadProgram(image);
+		results.back().mismatches = checkRewind(clock);
+		programChip.setQuirks(0);
+		printResult(results.back());
+	}
+
+	if (jsonPath && !writeJson(jsonPath, results))
+		return 1;
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		if (results[i].mismatches > 0)
+			return 2;
+	}
+	return 0;
+}
@@ -1,6 +1,15 @@
 #include "chip8.h"
+#if CHIP8_JIT
+#include "chip8jit.h"
+#endif
+#if CHIP8_PROFILE
+#include "chip8profile.h"
+#endif
+#include "chip8rom.h"
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h> 
+#include <string.h>
 
 
 unsigned char chip8_fontset[80] =
@@ -23,18 +32,52 @@ unsigned char chip8_fontset[80] =
     0xF0, 0x80, 0xF0, 0x80, 0x80  //F
 };
 
+//SUPER-CHIP's 8x10 digits for FX30, loaded at CHIP8_BIG_FONT_ADDRESS straight after the small ones
+unsigned char chip8_bigfontset[160] =
+{
+    0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C, //0
+    0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, //1
+    0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF, //2
+    0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C, //3
+    0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06, //4
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C, //5
+    0x3E, 0x7C, 0xC0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C, //6
+    0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60, //7
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C, //8
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C, //9
+    0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, //A
+    0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, //B
+    0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, //C
+    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, //D
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, //E
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  //F
+};
+
 chip8::chip8() {
-    unsigned short opcode;
-    unsigned char memory[4096];
-    unsigned char cpuRegisters[16];
-    unsigned short indexRegister;
-    unsigned short programCounter;
-    unsigned char gfx[64 * 32];
-    unsigned char delayTimer;
-    unsigned char soundTimer;
-    unsigned short stack[16];
-    unsigned short stackPointer;
-    unsigned char currentKey[16];
+    jit = 0;
+    jitEnabled = true;
+#if CHIP8_PROFILE
+    profiler = new chip8Profiler();
+#endif
+    idle = false;
+    clockSpeed = CHIP8_DEFAULT_CLOCK;
+    timerPhase = 0;
+    cycleCount = 0;
+    randomSeed = CHIP8_DEFAULT_SEED;
+    randomState = randomStateFor(randomSeed);
+    quirks = 0;
+    addressMask = 0x0FFF;
+    interpreter = interpreterFor(0, std::make_index_sequence<CHIP8_QUIRK_COMPILED + 1>());
+    romHash = chip8RomHash(NULL, 0);
+}
+
+chip8::~chip8() {
+#if CHIP8_JIT
+    delete jit;
+#endif
+#if CHIP8_PROFILE
+    delete profiler;
+#endif
 }
 
 
@@ -47,427 +90,1268 @@ void chip8::initialize() {
     for(int i = 0; i < 80; ++i)
         memory[i] = chip8_fontset[i];	
 
-    // Clear display
-    for (int i = 0; i < 2048; ++i)
-        gfx[i] = 0;
+    // Clear display, back to low resolution drawing in plane 0
+    memset(display, 0, sizeof(display));
+    hires = 0;
+    planeMask = 1;
+
+    // Silent pattern at the default pitch
+    memset(audioPattern, 0, sizeof(audioPattern));
+    pitch = 64;
 
     // Clear stack
     for (int i = 0; i < 16; ++i)
         stack[i] = 0;
 
     for (int i = 0; i < 16; ++i)
-        currentKey[i] = cpuRegisters[i] = 0;
+        currentKey[i] = cpuRegisters[i] = flagRegisters[i] = 0;
 
     // Clear memory
-    for (int i = 0; i < 4096; ++i)
-        memory[i] = 0;
+    memset(memory, 0, sizeof(memory));
 
     // Load fontset
     for (int i = 0; i < 80; ++i)
         memory[i] = chip8_fontset[i];
+    for (int i = 0; i < 160; ++i)
+        memory[CHIP8_BIG_FONT_ADDRESS + i] = chip8_bigfontset[i];
 
     // Reset timers
     delayTimer = 0;
     soundTimer = 0;
+    timerPhase = 0;
+    cycleCount = 0;
+    waitingForKey = 0;
+    randomState = randomStateFor(randomSeed);
+    romHash = chip8RomHash(NULL, 0);
 
     // Clear screen once
     drawFlag = true;
+    dirtyRows = ~0ull;
+
+    decodeAll();
+#if CHIP8_PROFILE
+    profiler->setCallStack(stack, stackPointer, decodeCache, addressMask);
+#endif
 }
 
-void chip8::emulateCycle() {
-    //opcode is 2 bytes long so get 2 bytes from memory at current PC location
-    opcode = memory[programCounter] << 8 | memory[programCounter + 1];
-    //printf("%02x\n", (unsigned int)opcode);
-
-    //Decode opcode using https://johnearnest.github.io/Octo/docs/chip8ref.pdf as a reference
-    //Also using https://en.wikipedia.org/wiki/CHIP-8#Opcode_table as it has more detailed information
-    //At first we only care about the first 4 bits and can add further statements for additional opcodes if necessary
-    switch(opcode & 0xF000) {
+void chip8::decodeAt(unsigned short address) {
+    //opcode is 2 bytes long, the last byte of memory has nothing after it so treat it as 0
+    bool xoChip = (quirks & CHIP8_QUIRK_XO_CHIP) != 0;
+    decodedInstruction & d = decodeCache[address];
+    decode(memory[address] << 8 | (address < addressMask ? memory[address + 1] : 0), d, xoChip);
+
+    //XO-CHIP's skips step over the whole of a four byte F000 NNNN
+    if (xoChip && address + 3 <= addressMask && memory[address + 2] == 0xF0 && memory[address + 3] == 0x00)
+        d.skip = 6;
+}
+
+//XO-CHIP's own opcodes, false for anything else. Kept apart so decoding without XO-CHIP costs one branch
+static bool decodeXoChip(unsigned short op, decodedInstruction & d) {
+    if ((op & 0xFFF0) == 0x00D0)
+        d.handler = OP_00DN;
+    else if ((op & 0xF00F) == 0x5002)
+        d.handler = OP_5XY2;
+    else if ((op & 0xF00F) == 0x5003)
+        d.handler = OP_5XY3;
+    else if (op == 0xF000)
+        d.handler = OP_F000;    //Followed by the 16 bit address it loads
+    else if ((op & 0xF0FF) == 0xF001)
+        d.handler = OP_FN01;
+    else if (op == 0xF002)
+        d.handler = OP_F002;
+    else if ((op & 0xF0FF) == 0xF03A)
+        d.handler = OP_FX3A;
+    else
+        return false;
+    return true;
+}
+
+void chip8::decode(unsigned short op, decodedInstruction & d, bool xoChip) {
+    d.opcode = op;
+    d.x = (op & 0x0F00) >> 8;
+    d.y = (op & 0x00F0) >> 4;
+    d.nn = op & 0x00FF;
+    d.nnn = op & 0x0FFF;
+    d.skip = 4;
+
+    if (xoChip && decodeXoChip(op, d))
+        return;
+
+    //Same groupings as the old nested switch so every opcode still lands on the same behaviour,
+    //apart from the exact SUPER-CHIP opcodes picked out first
+    switch (op & 0xF000) {
         case 0x0000:
-            switch (opcode & 0x000F)
-            {
-            case 0x0000: //0x00E0 CLEAR SCREEN
+            if ((op & 0xFFF0) == 0x00C0 && (op & 0x000F) != 0)
             {
-                for (int i = 0; i < 64 * 32; ++i)
-                    gfx[i] = 0x0;
-                programCounter += 2;
+                d.handler = OP_00CN;
                 break;
             }
-            case 0x000E:
-            {
-                --stackPointer;
-                programCounter = stack[stackPointer];
-                break;
+            switch (op) {
+                case 0x00FB: d.handler = OP_00FB; return;
+                case 0x00FC: d.handler = OP_00FC; return;
+                case 0x00FD: d.handler = OP_00FD; return;
+                case 0x00FE: d.handler = OP_00FE; return;
+                case 0x00FF: d.handler = OP_00FF; return;
             }
-            default: //UNKOWN WE'LL JUST IGNORE
-                printf("Opcode not known or not implemented [0x0000]: 0x%X\n", opcode);
-                break;
+            switch (op & 0x000F) {
+                case 0x0000: d.handler = OP_00E0; break;
+                case 0x000E: d.handler = OP_00EE; break;
+                default: d.handler = OP_UNKNOWN; break;
             }
             break;
-
-        case 0x1000: //Jumps to address
-        {
-            programCounter = opcode & 0x0FFF;
+        case 0x1000: d.handler = OP_1NNN; break;
+        case 0x2000: d.handler = OP_2NNN; break;
+        case 0x3000: d.handler = OP_3XNN; break;
+        case 0x4000: d.handler = OP_4XNN; break;
+        case 0x5000: d.handler = OP_5XY0; break;
+        case 0x6000: d.handler = OP_6XNN; break;
+        case 0x7000: d.handler = OP_7XNN; break;
+        case 0x8000:
+            switch (op & 0x000F) {
+                case 0x0000: d.handler = OP_8XY0; break;
+                case 0x0001: d.handler = OP_8XY1; break;
+                case 0x0002: d.handler = OP_8XY2; break;
+                case 0x0003: d.handler = OP_8XY3; break;
+                case 0x0004: d.handler = OP_8XY4; break;
+                case 0x0005: d.handler = OP_8XY5; break;
+                case 0x0006: d.handler = OP_8XY6; break;
+                case 0x0007: d.handler = OP_8XY7; break;
+                case 0x000E: d.handler = OP_8XYE; break;
+                default: d.handler = OP_IGNORED; break;
+            }
             break;
-        }
-        case 0x2000: //Call subroutine
-        {
-            programCounter += 2;
-            stack[stackPointer] = programCounter;
-            ++stackPointer;
-            programCounter = opcode & 0x0FFF;
+        case 0x9000: d.handler = OP_9XY0; break;
+        case 0xA000: d.handler = OP_ANNN; break;
+        case 0xB000: d.handler = OP_BNNN; break;
+        case 0xC000: d.handler = OP_CXNN; break;
+        case 0xD000: d.handler = (op & 0x000F) == 0 ? OP_DXY0 : OP_DXYN; break;
+        case 0xE000:
+            switch (op & 0x000F) {
+                case 0x000E: d.handler = OP_EX9E; break;
+                case 0x0001: d.handler = OP_EXA1; break;
+                default: d.handler = OP_IGNORED; break;
+            }
             break;
-        }
-        case 0x3000: //If VX == to NN skip next instruction
-        {
-            if (cpuRegisters[(opcode & 0x0F00) >> 8] == (opcode & 0x00FF))
-                programCounter += 4;
-            else
-                programCounter += 2;
+        case 0xF000:
+            switch (op & 0x00FF) {
+                case 0x0007: d.handler = OP_FX07; break;
+                case 0x000A: d.handler = OP_FX0A; break;
+                case 0x0015: d.handler = OP_FX15; break;
+                case 0x0018: d.handler = OP_FX18; break;
+                case 0x001E: d.handler = OP_FX1E; break;
+                case 0x0029: d.handler = OP_FX29; break;
+                case 0x0030: d.handler = OP_FX30; break;
+                case 0x0033: d.handler = OP_FX33; break;
+                case 0x0055: d.handler = OP_FX55; break;
+                case 0x0065: d.handler = OP_FX65; break;
+                case 0x0075: d.handler = OP_FX75; break;
+                case 0x0085: d.handler = OP_FX85; break;
+                default: d.handler = OP_IGNORED; break;
+            }
             break;
-        }
-        case 0x4000: //If vx != to vy skip next line
+    }
+}
+
+void chip8::decodeAll() {
+    for (int i = 0; i <= addressMask; ++i)
+        decodeAt(i);
+
+#if CHIP8_JIT
+    if (jit)
+        jit->invalidate(0, 4096);
+#endif
+}
+
+void chip8::invalidateCode(unsigned short address, unsigned short length) {
+    //A write can change the instruction starting at that byte and the one starting just before it, and with
+    //XO-CHIP how far a skip two bytes further back goes. Writes off the top of memory carry on at the bottom
+    int back = (quirks & CHIP8_QUIRK_XO_CHIP) ? 3 : 1;
+    int start = address > back ? address - back : 0;
+    int end = address + length;
+    if (end > addressMask + 1)
+    {
+        invalidateCode(0, end - (addressMask + 1));
+        end = addressMask + 1;
+    }
+
+    for (int i = start; i < end; ++i)
+        decodeAt(i);
+
+#if CHIP8_JIT
+    if (jit)
+        jit->invalidate(start, end);
+#endif
+}
+
+//Sprite rows are lined up with the left edge of a 128 bit row and shifted across both words at once. Pixels
+//off the right edge come back on the left, or with the clip quirk are shifted off the end, and rows off the
+//bottom carry on from the top unless clipped there. With both planes selected, plane 1's sprite follows
+//plane 0's in memory
+template<class Quirks>
+void chip8::drawSprite(unsigned char x, unsigned char y, int lines, bool wide) {
+    int width = getDisplayWidth();
+    int height = getDisplayHeight();
+    x &= width - 1;
+    y &= height - 1;
+    int visible = Quirks::clip && y + lines > height ? height - y : lines;
+    int bytesPerLine = wide ? 2 : 1;
+
+    uint64_t collision = 0;
+    uint64_t touched = 0;
+    unsigned short spriteAddress = indexRegister;
+    for (int plane = 0; plane < 2; ++plane)
+    {
+        if ((planeMask & (1 << plane)) == 0)
+            continue;
+
+        uint64_t (*rows)[2] = display[plane];
+        for (int line = 0; line < visible; ++line)
         {
-            if (cpuRegisters[(opcode & 0x0F00) >> 8] != (opcode & 0x00FF))
-                programCounter += 4;
+            unsigned short address = spriteAddress + line * bytesPerLine;
+            uint64_t sprite = (uint64_t)memory[address & addressMask] << 56;
+            if (wide)
+                sprite |= (uint64_t)memory[(address + 1) & addressMask] << 48;
+
+            uint64_t left, right = 0;
+            if (!hires)
+                left = x == 0 ? sprite : Quirks::clip ? sprite >> x : (sprite >> x) | (sprite << (64 - x));
+            else if (x < 64)
+            {
+                //At most 16 pixels wide, so nothing reaches past the right word yet
+                left = x == 0 ? sprite : sprite >> x;
+                right = x == 0 ? 0 : sprite << (64 - x);
+            }
             else
-                programCounter += 2;
-            break;
+            {
+                int shift = x - 64;
+                right = shift == 0 ? sprite : sprite >> shift;
+                left = shift == 0 || Quirks::clip ? 0 : sprite << (64 - shift);
+            }
+
+            int row = (y + line) & (height - 1);
+            collision |= (rows[row][0] & left) | (rows[row][1] & right);
+            rows[row][0] ^= left;
+            rows[row][1] ^= right;
+            touched |= 1ull << row;
         }
-        case 0x5000: //If vx == to vy skip next line
+        spriteAddress += lines * bytesPerLine;
+    }
+
+    cpuRegisters[0xF] = collision != 0;
+    dirtyRows |= touched;
+    drawFlag = true;
+}
+
+//Decode opcode using https://johnearnest.github.io/Octo/docs/chip8ref.pdf as a reference
+//Also using https://en.wikipedia.org/wiki/CHIP-8#Opcode_table as it has more detailed information
+//Each handler does exactly one instruction, every dispatch engine below calls the same ones
+
+template<class Quirks>
+void chip8::op00E0(const decodedInstruction & d) { //0x00E0 CLEAR SCREEN, the selected planes of it
+    for (int plane = 0; plane < 2; ++plane)
+        if (planeMask & (1 << plane))
+            memset(display[plane], 0, sizeof(display[plane]));
+    dirtyRows = ~0ull;
+    drawFlag = true;
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::op00CN(const decodedInstruction & d) { //Scroll down N rows
+    int height = getDisplayHeight();
+    int rows = d.nn & 0x000F;
+    for (int plane = 0; plane < 2; ++plane)
+    {
+        if ((planeMask & (1 << plane)) == 0)
+            continue;
+        memmove(display[plane][rows], display[plane][0], (height - rows) * sizeof(display[plane][0]));
+        memset(display[plane][0], 0, rows * sizeof(display[plane][0]));
+    }
+    dirtyRows = ~0ull;
+    drawFlag = true;
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::op00FB(const decodedInstruction & d) { //Scroll right 4 pixels, carrying from the left word into the right one
+    int height = getDisplayHeight();
+    for (int plane = 0; plane < 2; ++plane)
+    {
+        if ((planeMask & (1 << plane)) == 0)
+            continue;
+
+        uint64_t (*rows)[2] = display[plane];
+        for (int y = 0; y < height; ++y)
         {
-            if (cpuRegisters[(opcode & 0x0F00) >> 8] == cpuRegisters[(opcode & 0x00F0) >> 4])
-                programCounter += 4;
-            else
-                programCounter += 2;
-            break;
+            if (hires)
+                rows[y][1] = (rows[y][1] >> 4) | (rows[y][0] << 60);
+            rows[y][0] >>= 4;
         }
-        case 0x6000: //Set VX to NN
+    }
+    dirtyRows = ~0ull;
+    drawFlag = true;
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::op00FC(const decodedInstruction & d) { //Scroll left 4 pixels
+    int height = getDisplayHeight();
+    for (int plane = 0; plane < 2; ++plane)
+    {
+        if ((planeMask & (1 << plane)) == 0)
+            continue;
+
+        uint64_t (*rows)[2] = display[plane];
+        for (int y = 0; y < height; ++y)
         {
-            cpuRegisters[(opcode & 0x0F00) >> 8] = opcode & 0x00FF;
-            programCounter += 2;
-            break;
+            rows[y][0] = (rows[y][0] << 4) | (rows[y][1] >> 60);
+            rows[y][1] <<= 4;
         }
-        case 0x7000: //Add NN to VX
+    }
+    dirtyRows = ~0ull;
+    drawFlag = true;
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::op00DN(const decodedInstruction & d) { //Scroll up N rows
+    int height = getDisplayHeight();
+    int rows = d.nn & 0x000F;
+    for (int plane = 0; plane < 2; ++plane)
+    {
+        if ((planeMask & (1 << plane)) == 0)
+            continue;
+        memmove(display[plane][0], display[plane][rows], (height - rows) * sizeof(display[plane][0]));
+        memset(display[plane][height - rows], 0, rows * sizeof(display[plane][0]));
+    }
+    dirtyRows = ~0ull;
+    drawFlag = true;
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::op00FD(const decodedInstruction & d) { //Exit, the machine stays on this instruction from then on
+}
+
+template<class Quirks>
+void chip8::op00FE(const decodedInstruction & d) { //Low resolution, which clears the screen
+    memset(display, 0, sizeof(display));
+    hires = 0;
+    dirtyRows = ~0ull;
+    drawFlag = true;
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::op00FF(const decodedInstruction & d) { //High resolution, which clears the screen
+    memset(display, 0, sizeof(display));
+    hires = 1;
+    dirtyRows = ~0ull;
+    drawFlag = true;
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::op00EE(const decodedInstruction & d) {
+    --stackPointer;
+    programCounter = stack[stackPointer];
+}
+
+template<class Quirks>
+void chip8::op1NNN(const decodedInstruction & d) { //Jumps to address
+    programCounter = d.nnn;
+}
+
+template<class Quirks>
+void chip8::op2NNN(const decodedInstruction & d) { //Call subroutine
+    programCounter += 2;
+    stack[stackPointer] = programCounter;
+    ++stackPointer;
+    programCounter = d.nnn;
+}
+
+template<class Quirks>
+void chip8::op3XNN(const decodedInstruction & d) { //If VX == to NN skip next instruction
+    if (cpuRegisters[d.x] == d.nn)
+        programCounter += d.skip;
+    else
+        programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::op4XNN(const decodedInstruction & d) { //If vx != to vy skip next line
+    if (cpuRegisters[d.x] != d.nn)
+        programCounter += d.skip;
+    else
+        programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::op5XY0(const decodedInstruction & d) { //If vx == to vy skip next line
+    if (cpuRegisters[d.x] == cpuRegisters[d.y])
+        programCounter += d.skip;
+    else
+        programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::op5XY2(const decodedInstruction & d) { //Saves VX to VY at I, counting down if X is above Y. I stays where it was
+    int step = d.x <= d.y ? 1 : -1;
+    int count = (d.x <= d.y ? d.y - d.x : d.x - d.y) + 1;
+    for (int i = 0; i < count; ++i)
+        memory[(indexRegister + i) & addressMask] = cpuRegisters[d.x + i * step];
+    invalidateCode(indexRegister & addressMask, count);
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::op5XY3(const decodedInstruction & d) { //Loads VX to VY from I, the same way round as 5XY2
+    int step = d.x <= d.y ? 1 : -1;
+    int count = (d.x <= d.y ? d.y - d.x : d.x - d.y) + 1;
+    for (int i = 0; i < count; ++i)
+        cpuRegisters[d.x + i * step] = memory[(indexRegister + i) & addressMask];
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::op6XNN(const decodedInstruction & d) { //Set VX to NN
+    cpuRegisters[d.x] = d.nn;
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::op7XNN(const decodedInstruction & d) { //Add NN to VX
+    cpuRegisters[d.x] += d.nn;
+    programCounter += 2;
+}
+
+//Whole lotta math with VX and VY
+template<class Quirks>
+void chip8::op8XY0(const decodedInstruction & d) { //Set VX to VY
+    cpuRegisters[d.x] = cpuRegisters[d.y];
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::op8XY1(const decodedInstruction & d) { //Set VX to the OR value of VX and VY
+    cpuRegisters[d.x] = cpuRegisters[d.x] | cpuRegisters[d.y];
+    if (Quirks::vfReset)
+        cpuRegisters[0xF] = 0;
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::op8XY2(const decodedInstruction & d) { //Set VX to the AND value of VX and VY
+    cpuRegisters[d.x] = cpuRegisters[d.x] & cpuRegisters[d.y];
+    if (Quirks::vfReset)
+        cpuRegisters[0xF] = 0;
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::op8XY3(const decodedInstruction & d) { //Set VX to the XOR value of VX and VY
+    cpuRegisters[d.x] = cpuRegisters[d.x] ^ cpuRegisters[d.y];
+    if (Quirks::vfReset)
+        cpuRegisters[0xF] = 0;
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::op8XY4(const decodedInstruction & d) { //Adds VY to VX. VF is set to 1 when there's a carry, and to 0 when there is not.
+    if (cpuRegisters[d.y] > (0xFF - cpuRegisters[d.x]))
+        cpuRegisters[0xF] = 1; //Final register slot is used for carry
+    else
+        cpuRegisters[0xF] = 0;
+    cpuRegisters[d.x] += cpuRegisters[d.y];
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::op8XY5(const decodedInstruction & d) { //VY is subtracted from VX. VF is set to 0 when there's a borrow, and 1 when there is not.
+    if (cpuRegisters[d.y] > cpuRegisters[d.x])
+        cpuRegisters[0xF] = 0;
+    else
+        cpuRegisters[0xF] = 1;
+    cpuRegisters[d.x] -= cpuRegisters[d.y];
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::op8XY6(const decodedInstruction & d) { //Stores the least significant bit of VX in VF and then shifts VX to the right by 1.
+    //Without the quirk VF is written first, as it always was, so 8FY6 leaves the shifted value in VF
+    if (Quirks::shiftVY)
+    {
+        unsigned char source = cpuRegisters[d.y];
+        cpuRegisters[d.x] = source >> 1;
+        cpuRegisters[0xF] = source & 0x1;
+    }
+    else
+    {
+        cpuRegisters[0xF] = cpuRegisters[d.x] & 0x1;
+        cpuRegisters[d.x] = cpuRegisters[d.x] >> 1;
+    }
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::op8XY7(const decodedInstruction & d) {
+    if (cpuRegisters[d.y] < cpuRegisters[d.x])
+        cpuRegisters[0xF] = 0;
+    else
+        cpuRegisters[0xF] = 1;
+    cpuRegisters[d.x] = cpuRegisters[d.y] - cpuRegisters[d.x];
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::op8XYE(const decodedInstruction & d) {
+    if (Quirks::shiftVY)
+    {
+        unsigned char source = cpuRegisters[d.y];
+        cpuRegisters[d.x] = source << 1;
+        cpuRegisters[0xF] = source >> 7;
+    }
+    else
+    {
+        cpuRegisters[0xF] = cpuRegisters[d.x] >> 7;
+        cpuRegisters[d.x] = cpuRegisters[d.x] << 1;
+    }
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::op9XY0(const decodedInstruction & d) {
+    if (cpuRegisters[d.x] != cpuRegisters[d.y])
+        programCounter += d.skip;
+    else
+        programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::opANNN(const decodedInstruction & d) {
+    indexRegister = d.nnn;
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::opBNNN(const decodedInstruction & d) {
+    programCounter = d.nnn + cpuRegisters[Quirks::jumpVX ? d.x : 0];
+}
+
+template<class Quirks>
+void chip8::opCXNN(const decodedInstruction & d) {
+    cpuRegisters[d.x] = nextRandom(randomState) & d.nn;
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::opDXYN(const decodedInstruction & d) {
+    drawSprite<Quirks>(cpuRegisters[d.x], cpuRegisters[d.y], d.nn & 0x000F, false);
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::opDXY0(const decodedInstruction & d) { //16x16 sprite, two bytes a row
+    drawSprite<Quirks>(cpuRegisters[d.x], cpuRegisters[d.y], 16, true);
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::opEX9E(const decodedInstruction & d) { //Skip next instruction if key stored in VX is pressed
+    if (currentKey[cpuRegisters[d.x]] != 0)
+        programCounter += d.skip;
+    else
+        programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::opEXA1(const decodedInstruction & d) { //Skip next instruction if key stored in VX is not pressed
+    if (currentKey[cpuRegisters[d.x]] == 0)
+        programCounter += d.skip;
+    else
+        programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::opFX07(const decodedInstruction & d) { //Sets VX to the value of the delay timer.
+    cpuRegisters[d.x] = delayTimer;
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::opFX0A(const decodedInstruction & d) { //A key press is awaited, and then stored in VX. (Blocking Operation. All instruction halted until next key event);
+    bool keyPress = false;
+
+    for (int i = 0; i < 16; ++i)
+    {
+        if (currentKey[i] != 0)
         {
-            cpuRegisters[(opcode & 0x0F00) >> 8] += opcode & 0x00FF;
-            programCounter += 2;
-            break;
+            cpuRegisters[d.x] = i;
+            keyPress = true;
         }
-        case 0x8000: //Whole lotta math with VX and VY
-            switch (opcode & 0x000F) {
-                case 0x0000: //Set VX to VY
-                {
-                    cpuRegisters[(opcode & 0x0F00) >> 8] = cpuRegisters[(opcode & 0x00F0) >> 4];
-                    programCounter += 2;
-                    break;
-                }
-
-                case 0x0001:    //Set VX to the OR value of VX and VY
-                {
-                    cpuRegisters[(opcode & 0x0F00) >> 8] = cpuRegisters[(opcode & 0x0F00) >> 8] | cpuRegisters[(opcode & 0x00F0) >> 4];
-                    programCounter += 2;
-                    break;
-                }
-
-                case 0x0002:    //Set VX to the AND value of VX and VY
-                {
-                    cpuRegisters[(opcode & 0x0F00) >> 8] = cpuRegisters[(opcode & 0x0F00) >> 8] & cpuRegisters[(opcode & 0x00F0) >> 4];
-                    programCounter += 2;
-                    break;
-                }
-
-                case 0x0003:    //Set VX to the XOR value of VX and VY
-                {
-                    cpuRegisters[(opcode & 0x0F00) >> 8] = cpuRegisters[(opcode & 0x0F00) >> 8] ^ cpuRegisters[(opcode & 0x00F0) >> 4];
-                    programCounter += 2;
-                    break;
-                }
-
-                case 0x0004:    //Adds VY to VX. VF is set to 1 when there's a carry, and to 0 when there is not.
-                {
-                    if (cpuRegisters[(opcode & 0x00F0) >> 4] > (0xFF - cpuRegisters[(opcode & 0x0F00) >> 8]))
-                        cpuRegisters[0xF] = 1; //Final register slot is used for carry
-                    else
-                        cpuRegisters[0xF] = 0;
-                    cpuRegisters[(opcode & 0x0F00) >> 8] += cpuRegisters[(opcode & 0x00F0) >> 4];
-                    programCounter += 2;
-                    break;
-                }
-
-                case 0x0005:    //VY is subtracted from VX. VF is set to 0 when there's a borrow, and 1 when there is not.
-                {
-                    if (cpuRegisters[(opcode & 0x00F0) >> 4] > cpuRegisters[(opcode & 0x0F00) >> 8])
-                        cpuRegisters[0xF] = 0;
-                    else
-                        cpuRegisters[0xF] = 1;
-                    cpuRegisters[(opcode & 0x0F00) >> 8] -= cpuRegisters[(opcode & 0x00F0) >> 4];
-                    programCounter += 2;
-                    break;
-                }
-
-                case 0x0006:    //Stores the least significant bit of VX in VF and then shifts VX to the right by 1.
-                {
-                    cpuRegisters[0xF] = cpuRegisters[(opcode & 0x0F00) >> 8] & 0x1;
-                    cpuRegisters[(opcode & 0x0F00) >> 8] = cpuRegisters[(opcode & 0x0F00) >> 8] >> 1;
-                    programCounter += 2;
-                    break;
-                }
-
-                case 0x0007:
-                {
-                    if (cpuRegisters[(opcode & 0x00F0) >> 4] < cpuRegisters[(opcode & 0x0F00) >> 8])
-                        cpuRegisters[0xF] = 0;
-                    else
-                        cpuRegisters[0xF] = 1;
-                    cpuRegisters[(opcode & 0x0F00) >> 8] = cpuRegisters[(opcode & 0x00F0) >> 4] - cpuRegisters[(opcode & 0x0F00) >> 8];
-                    programCounter += 2;
-                    break;
-                }
-
-                case 0x000E:
-                {
-                    cpuRegisters[0xF] = cpuRegisters[(opcode & 0x0F00) >> 8] >> 7;
-                    cpuRegisters[(opcode & 0x0F00) >> 8] = cpuRegisters[(opcode & 0x0F00) >> 8] << 1;
-                    programCounter += 2;
-                    break;
-                }
-            }
-            break;
-        case 0x9000:
+    }
+
+    // If we didn't received a keypress, leave the PC here and halt. emulateCycles runs nothing until a key
+    // is down, the timers keep counting meanwhile
+    if (!keyPress)
+    {
+        waitingForKey = 1;
+        return;
+    }
+
+    waitingForKey = 0;
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::opFX15(const decodedInstruction & d) { // Sets the delay timer to VX.
+    delayTimer = cpuRegisters[d.x];
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::opFX18(const decodedInstruction & d) { // Sets the sound timer to VX.
+    soundTimer = cpuRegisters[d.x];
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::opFX1E(const decodedInstruction & d) { // Adds VX to I. VF is not affected.
+    indexRegister += cpuRegisters[d.x];
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::opFX29(const decodedInstruction & d) { // Sets I to the location of the sprite for the character in VX. Characters 0-F (in hexadecimal) are represented by a 4x5 font.
+    indexRegister = cpuRegisters[d.x] * 0x5;
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::opFX30(const decodedInstruction & d) { // Sets I to the 8x10 SUPER-CHIP digit for the low nibble of VX
+    indexRegister = CHIP8_BIG_FONT_ADDRESS + (cpuRegisters[d.x] & 0xF) * 10;
+    programCounter += 2;
+}
+
+// Stores the binary-coded decimal representation of VX, with the most significant of three digits at the address in I, the middle digit at I plus 1, and the least significant digit at I plus 2.
+template<class Quirks>
+void chip8::opFX33(const decodedInstruction & d) {
+    memory[indexRegister & addressMask] = cpuRegisters[d.x] / 100;
+    memory[(indexRegister + 1) & addressMask] = (cpuRegisters[d.x] / 10) % 10;
+    memory[(indexRegister + 2) & addressMask] = (cpuRegisters[d.x] % 100) % 10;
+    invalidateCode(indexRegister & addressMask, 3);
+    programCounter += 2;
+}
+
+// Stores from V0 to VX (including VX) in memory, starting at address I. The offset from I is increased by 1 for each value written, but I itself is left unmodified.
+template<class Quirks>
+void chip8::opFX55(const decodedInstruction & d) {
+    for (int i = 0; i <= d.x; ++i)
+        memory[(indexRegister + i) & addressMask] = cpuRegisters[i];
+    invalidateCode(indexRegister & addressMask, d.x + 1);
+
+    // On the original interpreter, when the operation is done, I = I + X + 1.
+    if (!Quirks::keepI)
+        indexRegister += d.x + 1;
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::opFX75(const decodedInstruction & d) { // Saves V0 to VX in the user flags
+    for (int i = 0; i <= d.x; ++i)
+        flagRegisters[i] = cpuRegisters[i];
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::opFX85(const decodedInstruction & d) { // Loads V0 to VX back from the user flags
+    for (int i = 0; i <= d.x; ++i)
+        cpuRegisters[i] = flagRegisters[i];
+    programCounter += 2;
+}
+
+// Fills from V0 to VX (including VX) with values from memory, starting at address I. The offset from I is increased by 1 for each value written, but I itself is left unmodified.
+template<class Quirks>
+void chip8::opFX65(const decodedInstruction & d) {
+    for (int i = 0; i <= d.x; ++i)
+        cpuRegisters[i] = memory[(indexRegister + i) & addressMask];
+
+    // On the original interpreter, when the operation is done, I = I + X + 1.
+    if (!Quirks::keepI)
+        indexRegister += d.x + 1;
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::opF000(const decodedInstruction & d) { //Loads I with the 16 bit address in the two bytes after it
+    indexRegister = memory[(programCounter + 2) & addressMask] << 8 | memory[(programCounter + 3) & addressMask];
+    programCounter += 4;
+}
+
+template<class Quirks>
+void chip8::opFN01(const decodedInstruction & d) { //Selects the planes drawing, clearing and scrolling work on
+    planeMask = d.x & 3;
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::opF002(const decodedInstruction & d) { //Loads the 16 byte audio pattern from I
+    for (int i = 0; i < 16; ++i)
+        audioPattern[i] = memory[(indexRegister + i) & addressMask];
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::opFX3A(const decodedInstruction & d) { //Sets the audio pitch to VX
+    pitch = cpuRegisters[d.x];
+    programCounter += 2;
+}
+
+template<class Quirks>
+void chip8::opUNKNOWN(const decodedInstruction & d) { //UNKOWN WE'LL JUST IGNORE
+    eventLog.push(CHIP8_EVENT_UNKNOWN_OPCODE, programCounter, d.opcode, cycleCount);
+}
+
+template<class Quirks>
+void chip8::opIGNORED(const decodedInstruction & d) {
+}
+
+//Same as ticking both timers once, ticks times over
+void chip8::tickTimers(unsigned int ticks) {
+    delayTimer = delayTimer > ticks ? delayTimer - ticks : 0;
+
+    if (soundTimer > 0)
+    {
+        if (soundTimer <= ticks)
         {
-            if (cpuRegisters[(opcode & 0x0F00) >> 8] != cpuRegisters[(opcode & 0x00F0) >> 4])
-                programCounter += 4;
-            else
-                programCounter += 2;
+            eventLog.push(CHIP8_EVENT_BEEP, programCounter, opcode, cycleCount);
+            soundTimer = 0;
         }
-            break;
-        case 0xA000:
-        {
-            indexRegister = opcode & 0x0FFF;
-            programCounter += 2;
-            break;
+        else
+            soundTimer -= ticks;
+    }
+}
+
+//Moves emulated time on by cycles instructions and ticks the timers for every 60th of a second that passed.
+//The remainder carries over so the rate is exactly 60Hz for any clock, not just multiples of 60
+void chip8::advanceClock(unsigned long cycles) {
+    cycleCount += cycles;
+    timerPhase += 60ull * cycles;
+    if (timerPhase < clockSpeed)
+        return;
+
+    unsigned long long ticks = timerPhase / clockSpeed;
+    timerPhase %= clockSpeed;
+    tickTimers(ticks > 255 ? 255 : (unsigned int)ticks);
+}
+
+void chip8::seedRandom(uint64_t seed) {
+    randomSeed = seed;
+    randomState = randomStateFor(seed);
+}
+
+void chip8::setQuirks(unsigned int flags) {
+    quirks = flags & CHIP8_QUIRK_ALL;
+    interpreter = interpreterFor(quirks & CHIP8_QUIRK_COMPILED, std::make_index_sequence<CHIP8_QUIRK_COMPILED + 1>());
+    addressMask = (quirks & CHIP8_QUIRK_XO_CHIP) ? 0xFFFF : 0x0FFF;
+
+    //XO-CHIP changes what opcodes decode to, and the JIT's blocks were translated for the old quirks
+    decodeAll();
+}
+
+void chip8::setClockSpeed(unsigned int instructionsPerSecond) {
+    clockSpeed = instructionsPerSecond < 60 ? 60 : instructionsPerSecond;
+    timerPhase %= clockSpeed;
+}
+
+//Counts the instruction at PC before it runs, nothing at all in a normal build
+#if CHIP8_PROFILE
+#define PROFILE_INSTRUCTION(d) profiler->count(programCounter, d)
+#else
+#define PROFILE_INSTRUCTION(d)
+#endif
+
+//Each engine is a template over the quirk policy, so every instantiation has its quirks compiled in and
+//nothing is checked per instruction. setQuirks picks which one emulateCycles runs
+
+#if CHIP8_DISPATCH == CHIP8_DISPATCH_SWITCH
+
+//Reference engine, one switch over the handler index
+template<class Quirks>
+void chip8::interpretCycles(unsigned long count) {
+    while (count-- > 0)
+    {
+        //Instructions are decoded once when they're loaded (or written over), so just look up this PC's entry
+        const decodedInstruction & d = decodeCache[programCounter & addressMask];
+        opcode = d.opcode;
+        PROFILE_INSTRUCTION(d);
+
+        switch (d.handler) {
+#define X(name) case OP_##name: op##name<Quirks>(d); break;
+            CHIP8_HANDLER_LIST(X)
+#undef X
+            default:
+                break;
         }
-        case 0xB000:
+
+        advanceClock(1);
+    }
+}
+
+#elif CHIP8_DISPATCH == CHIP8_DISPATCH_TABLE
+
+//One indirect call through a table of handlers indexed by the decoded handler
+typedef void (chip8::*chip8HandlerFunction)(const decodedInstruction &);
+
+template<class Quirks>
+void chip8::interpretCycles(unsigned long count) {
+    static const chip8HandlerFunction handlerTable[OP_COUNT] =
+    {
+#define X(name) &chip8::op##name<Quirks>,
+        CHIP8_HANDLER_LIST(X)
+#undef X
+    };
+
+    while (count-- > 0)
+    {
+        const decodedInstruction & d = decodeCache[programCounter & addressMask];
+        opcode = d.opcode;
+        PROFILE_INSTRUCTION(d);
+
+        (this->*handlerTable[d.handler])(d);
+
+        advanceClock(1);
+    }
+}
+
+#elif CHIP8_DISPATCH == CHIP8_DISPATCH_GOTO
+
+#if !defined(__GNUC__)
+#error "CHIP8_DISPATCH_GOTO needs the labels-as-values extension (GCC or Clang)"
+#endif
+
+//Threaded code: every handler label finishes by jumping straight to the next instruction's label,
+//so each opcode gets its own indirect branch for the predictor to learn
+template<class Quirks>
+void chip8::interpretCycles(unsigned long count) {
+    static void * const labels[OP_COUNT] =
+    {
+#define X(name) &&label##name,
+        CHIP8_HANDLER_LIST(X)
+#undef X
+    };
+
+    const decodedInstruction * d;
+
+#define DISPATCH_NEXT() \
+    do { \
+        if (count-- == 0) \
+            return; \
+        d = &decodeCache[programCounter & addressMask]; \
+        opcode = d->opcode; \
+        PROFILE_INSTRUCTION(*d); \
+        goto *labels[d->handler]; \
+    } while (0)
+
+    DISPATCH_NEXT();
+
+#define X(name) \
+    label##name: \
+        op##name<Quirks>(*d); \
+        advanceClock(1); \
+        DISPATCH_NEXT();
+    CHIP8_HANDLER_LIST(X)
+#undef X
+
+#undef DISPATCH_NEXT
+}
+
+#else
+#error "Unknown CHIP8_DISPATCH engine"
+#endif
+
+//The front door: one instantiation for every combination of quirk flags, indexed by the flags
+template<size_t... Flags>
+chip8::interpreterFunction chip8::interpreterFor(unsigned int flags, std::index_sequence<Flags...>) {
+    static const interpreterFunction interpreters[] = { &chip8::interpretCycles<chip8QuirkPolicy<Flags> >... };
+    return interpreters[flags];
+}
+
+void chip8::emulateCycle() {
+    (this->*interpreter)(1);
+}
+
+//Instructions run between idle loop checks, short enough that a wait loop is caught early on
+#define IDLE_CHECK_INTERVAL 64
+
+//Length in instructions of the wait loop starting at address, or 0 if there isn't one. Only the shape,
+//skipIdleLoop decides whether the machine is actually stuck in it
+bool chip8::anyKeyDown() const {
+    bool keyDown = false;
+    for (int i = 0; i < 16; ++i)
+        keyDown |= currentKey[i] != 0;
+    return keyDown;
+}
+
+int chip8::idleLoopAt(unsigned short address) const {
+    if (address + 4 > addressMask)
+        return 0;
+
+    const decodedInstruction & first = decodeCache[address];
+    const decodedInstruction & second = decodeCache[address + 2];
+    const decodedInstruction & third = decodeCache[address + 4];
+
+    //Jump to itself, or exited
+    if ((first.handler == OP_1NNN && first.nnn == address) || first.handler == OP_00FD)
+        return 1;
+
+    //Polling a key
+    if ((first.handler == OP_EX9E || first.handler == OP_EXA1) && second.handler == OP_1NNN && second.nnn == address)
+        return 2;
+
+    //Waiting on the delay timer
+    if (first.handler == OP_FX07 && (second.handler == OP_3XNN || second.handler == OP_4XNN) && second.x == first.x &&
+        third.handler == OP_1NNN && third.nnn == address)
+        return 3;
+
+    return 0;
+}
+
+//Runs as many iterations of the wait loop at PC as it can prove change nothing but the clock, all in one go.
+//Returns the number of instructions skipped, 0 if PC isn't at the top of a loop the machine is stuck in.
+//Keys only change between emulateCycles calls, so nothing these loops read can change except the delay timer
+unsigned long chip8::skipIdleLoop(unsigned long budget) {
+    unsigned short pc = programCounter;
+    int length = idleLoopAt(pc);
+    if (length == 0)
+        return 0;
+
+    const decodedInstruction & first = decodeCache[pc];
+    const decodedInstruction & second = decodeCache[pc + 2];
+    unsigned long iterations = budget / length;
+
+    if (length == 2)
+    {
+        //Keys above F read past currentKey, leave those be
+        unsigned char key = cpuRegisters[first.x];
+        if (key > 0xF || (currentKey[key] != 0) == (first.handler == OP_EX9E))
+            return 0;
+    }
+    else if (length == 3)
+    {
+        //The delay timer only changes on 60Hz ticks and only ever counts down to 0, so work out how many
+        //ticks can go by with every FX07 still reading a value that keeps the loop going
+        bool untilEqual = second.handler == OP_3XNN;
+        if ((delayTimer == second.nn) == untilEqual || timerPhase >= clockSpeed)
+            return 0;
+
+        unsigned long long ticks = 0; //0 for never leaving
+        if (untilEqual && delayTimer > second.nn)
+            ticks = delayTimer - second.nn;
+        else if (!untilEqual && delayTimer > 0)
+            ticks = 1;
+
+        if (ticks > 0)
         {
-            programCounter = (opcode & 0x0FFF) + cpuRegisters[0];
-            break;
+            //Instructions up to and including the one the last of those ticks lands on, then every
+            //iteration whose FX07 comes before it
+            unsigned long long untilTick = (ticks * clockSpeed - timerPhase + 59) / 60;
+            if ((untilTick - 1) / 3 + 1 < iterations)
+                iterations = (untilTick - 1) / 3 + 1;
         }
-        case 0xC000:
+        if (iterations == 0)
+            return 0;
+
+        //The last FX07 reads whatever the timer is after all but the last iteration
+        advanceClock((iterations - 1) * 3);
+        cpuRegisters[first.x] = delayTimer;
+        advanceClock(3);
+        opcode = decodeCache[pc + 4].opcode;
+        return iterations * 3;
+    }
+
+    if (iterations == 0)
+        return 0;
+
+    advanceClock(iterations * length);
+    opcode = decodeCache[pc + (length - 1) * 2].opcode;
+    return iterations * length;
+}
+
+void chip8::emulateCycles(unsigned long count) {
+    idle = false;
+    while (count > 0)
+    {
+        //Halted in FX0A. Keys can't change until the next call, so nothing runs for the rest of this one
+        if (waitingForKey && !anyKeyDown())
         {
-            cpuRegisters[(opcode & 0x0F00) >> 8] = (rand() % 0xFF) & (opcode & 0x00FF);
-            programCounter += 2;
-            break;
+#if CHIP8_PROFILE
+            profiler->countRepeated(programCounter, decodeCache[programCounter & addressMask], count);
+#endif
+            advanceClock(count);
+            idle = true;
+            return;
         }
-        case 0xD000:
-        {
-            unsigned short x = cpuRegisters[(opcode & 0x0F00) >> 8];
-            unsigned short y = cpuRegisters[(opcode & 0x00F0) >> 4];
-            unsigned short height = opcode & 0x000F;
-            unsigned short pixel;
 
-            cpuRegisters[0xF] = 0;
-            for (int yline = 0; yline < height; yline++)
+        unsigned long skipped = skipIdleLoop(count);
+        if (skipped > 0)
+        {
+#if CHIP8_PROFILE
+            //Skipped loops end back at their top, so PC still says which loop it was
+            int length = idleLoopAt(programCounter);
+            for (int i = 0; i < length; ++i)
             {
-                pixel = memory[indexRegister + yline];
-                for (int xline = 0; xline < 8; xline++)
-                {
-                    if ((pixel & (0x80 >> xline)) != 0)
-                    {
-                        if (gfx[(x + xline + ((y + yline) * 64))] == 1)
-                        {
-                            cpuRegisters[0xF] = 1;
-                        }
-                        gfx[x + xline + ((y + yline) * 64)] ^= 1;
-                    }
-                }
+                unsigned short address = (programCounter + i * 2) & addressMask;
+                profiler->countRepeated(address, decodeCache[address], skipped / length);
             }
-
-            drawFlag = true;
-            programCounter += 2;
-            break;
+#endif
+            count -= skipped;
+            idle = true;
+            continue;
         }
+        idle = false;
 
-        case 0xE000:
+        //Partway into a wait loop, step to its top and check again. Otherwise run a stretch before the next look
+        unsigned short pc = programCounter;
+        unsigned long chunk = IDLE_CHECK_INTERVAL;
+        if ((pc >= 2 && idleLoopAt(pc - 2) > 1) || (pc >= 4 && idleLoopAt(pc - 4) > 2))
+            chunk = 1;
+        if (chunk > count)
+            chunk = count;
+
+#if CHIP8_JIT && !CHIP8_PROFILE
+        if (jitEnabled)
         {
-            switch (opcode & 0x000F)
+            if (jit == 0)
+                jit = new chip8Jit(*this);
+
+            //Translated blocks first, falling back to the interpreter for one instruction whenever there isn't one
+            unsigned long ran = jit->run(chunk);
+            if (ran == 0)
             {
-                case 0x000E: //Skip next instruction if key stored in VX is pressed
-                {
-                    if (currentKey[cpuRegisters[(opcode & 0x0F00) >> 8]] != 0)
-                        programCounter += 4;
-                    else
-                        programCounter += 2;
-                    break;
-                }
-                   
-                case 0x0001: //Skip next instruction if key stored in VX is not pressed
-                {
-                    if (currentKey[cpuRegisters[(opcode & 0x0F00) >> 8]] == 0)
-                        programCounter += 4;
-                    else
-                        programCounter += 2;
-                    break;
-                }
-
-                default:
-                    break;
+                (this->*interpreter)(1);
+                ran = 1;
             }
+            count -= ran;
+            continue;
         }
+#endif
+        (this->*interpreter)(chunk);
+        count -= chunk;
+    }
+}
 
-        case 0xF000:
+bool chip8::loadFile(const char * filename){
+    printf("Loading: %s\n", filename);
+
+    // Mapped rather than read, so the ROM's bytes are copied once, straight into memory
+    chip8RomFile rom;
+    if (!rom.open(filename))
+    {
+        initialize();
+        fputs("File error", stderr);
+        return false;
+    }
+    printf("Filesize: %d\n", (int)rom.size());
+
+    return loadProgram(rom.data(), rom.size());
+}
+
+bool chip8::loadProgram(const unsigned char * data, size_t size) {
+    initialize();
+
+    if (size > CHIP8_MEMORY_SIZE - 0x200)
+    {
+        fputs("Error: ROM too big for memory\n", stderr);
+        return false;
+    }
+
+    //initialize decoded the empty memory, only the ROM's bytes need decoding again
+    memcpy(memory + 0x200, data, size);
+    invalidateCode(0x200, size);
+    romHash = chip8RomHash(data, size);
+    return true;
+}
+
+void chip8::dumpRegisters(FILE * out) const {
+    fprintf(out, "PC=%03X I=%03X SP=%X DT=%02X ST=%02X V=", programCounter, indexRegister, stackPointer, delayTimer, soundTimer);
+    for (int i = 0; i < 16; ++i)
+        fprintf(out, "%02X", cpuRegisters[i]);
+}
+
+bool chip8::drawSprite(uint64_t * rows, const unsigned char * memory, unsigned short address, unsigned char x, unsigned char y, unsigned char height) {
+    uint64_t collision = 0;
+    x &= 63;
+    y &= 31;
+
+    //Each sprite byte is lined up with the left edge then rotated across, so pixels off the right edge come back on the left
+    for (int yline = 0; yline < height; yline++)
+    {
+        uint64_t sprite = (uint64_t)memory[(address + yline) & 0x0FFF] << 56;
+        if (x != 0)
+            sprite = (sprite >> x) | (sprite << (64 - x));
+
+        uint64_t & row = rows[(y + yline) & 31];
+        collision |= row & sprite;
+        row ^= sprite;
+    }
+
+    return collision != 0;
+}
+
+uint64_t chip8::takeDirtyRows() {
+    uint64_t rows = dirtyRows;
+    dirtyRows = 0;
+    drawFlag = false;
+    return rows;
+}
+
+//Memory is last in the state, so anything this machine can't reach is left out of a snapshot
+void chip8::saveState(chip8Snapshot & snapshot) const {
+    snapshot.magic = CHIP8_SNAPSHOT_MAGIC;
+    snapshot.version = CHIP8_SNAPSHOT_VERSION;
+    snapshot.stateSize = CHIP8_STATE_SIZE(addressMask);
+    snapshot.reserved = 0;
+    memcpy(&snapshot.state, static_cast<const chip8State *>(this), snapshot.stateSize);
+}
+
+static bool validSnapshotHeader(const chip8Snapshot & snapshot) {
+    return snapshot.magic == CHIP8_SNAPSHOT_MAGIC && snapshot.version == CHIP8_SNAPSHOT_VERSION &&
+        snapshot.stateSize >= CHIP8_STATE_SIZE(0x0FFF) && snapshot.stateSize <= sizeof(chip8State);
+}
+
+bool chip8::loadState(const chip8Snapshot & snapshot) {
+    if (!validSnapshotHeader(snapshot))
+    {
+        fputs("Save state is from a different version\n", stderr);
+        return false;
+    }
+
+    chip8State * state = this;
+    memcpy(state, &snapshot.state, offsetof(chip8State, memory));
+
+    //Only the runs of memory the restore changes are decoded again, so a rewind a frame back keeps the rest of
+    //the cache and the JIT's blocks. Memory past the end of a smaller snapshot is cleared
+    const unsigned char * incoming = snapshot.state.memory;
+    unsigned int incomingSize = snapshot.stateSize - offsetof(chip8State, memory);
+    unsigned int reach = addressMask + 1;
+    unsigned int i = 0;
+    int runStart = -1;
+    while (i < reach)
+    {
+        //Most of it is the same, skipped a word at a time
+        if (runStart < 0 && i + 8 <= incomingSize && i + 8 <= reach && memcmp(&memory[i], &incoming[i], 8) == 0)
         {
-            switch (opcode & 0x00FF)
-            {
-                case 0x0007: //Sets VX to the value of the delay timer. 
-                {
-                    cpuRegisters[(opcode & 0x0F00) >> 8] = delayTimer;
-                    programCounter += 2;
-                    break;
-                }
-                case 0x000A: //A key press is awaited, and then stored in VX. (Blocking Operation. All instruction halted until next key event); 
-                {
-                    bool keyPress = false;
-
-                    for (int i = 0; i < 16; ++i)
-                    {
-                        if (currentKey[i] != 0)
-                        {
-                            cpuRegisters[(opcode & 0x0F00) >> 8] = i;
-                            keyPress = true;
-                        }
-                    }
-
-                    // If we didn't received a keypress, skip this cycle and try again.
-                    if (!keyPress)
-                        return;
-
-                    programCounter += 2;
-                    break;
-                }
-                case 0x0015: // Sets the delay timer to VX.
-                {
-                    delayTimer = cpuRegisters[(opcode & 0x0F00) >> 8];
-                    programCounter += 2;
-                    break;
-                }
-                case 0x0018: // Sets the sound timer to VX. 
-                {
-                    soundTimer = cpuRegisters[(opcode & 0x0F00) >> 8];
-                    programCounter += 2;
-                    break;
-                }
-                case 0x001E: // Adds VX to I. VF is not affected.
-                {
-                    indexRegister += cpuRegisters[(opcode & 0x0F00) >> 8];
-                    programCounter += 2;
-                    break;
-                }
-                case 0x0029: // Sets I to the location of the sprite for the character in VX. Characters 0-F (in hexadecimal) are represented by a 4x5 font. 
-                {
-                    indexRegister = cpuRegisters[(opcode & 0x0F00) >> 8] * 0x5;
-                    programCounter += 2;
-                    break;
-                }
-                case 0x0033: // Stores the binary-coded decimal representation of VX, with the most significant of three digits at the address in I, the middle digit at I plus 1, and the least significant digit at I plus 2.
-                {
-                    memory[indexRegister] = cpuRegisters[(opcode & 0x0F00) >> 8] / 100;
-                    memory[indexRegister + 1] = (cpuRegisters[(opcode & 0x0F00) >> 8] / 10) % 10;
-                    memory[indexRegister + 2] = (cpuRegisters[(opcode & 0x0F00) >> 8] % 100) % 10;
-                    programCounter += 2;
-                    break;
-                }
-                case 0x0055: // Stores from V0 to VX (including VX) in memory, starting at address I. The offset from I is increased by 1 for each value written, but I itself is left unmodified.					
-                    for (int i = 0; i <= ((opcode & 0x0F00) >> 8); ++i)
-                        memory[indexRegister + i] = cpuRegisters[i];
-
-                    // On the original interpreter, when the operation is done, I = I + X + 1.
-                    indexRegister += ((opcode & 0x0F00) >> 8) + 1;
-                    programCounter += 2;
-                    break;
-
-                case 0x0065: // Fills from V0 to VX (including VX) with values from memory, starting at address I. The offset from I is increased by 1 for each value written, but I itself is left unmodified.[					
-                    for (int i = 0; i <= ((opcode & 0x0F00) >> 8); ++i)
-                        cpuRegisters[i] = memory[indexRegister + i];
-
-                    // On the original interpreter, when the operation is done, I = I + X + 1.
-                    indexRegister += ((opcode & 0x0F00) >> 8) + 1;
-                    programCounter += 2;
-                    break;
-                default:
-                    break;
-            }
-            break;
+            i += 8;
+            continue;
         }
 
-        default:
+        unsigned char byte = i < incomingSize ? incoming[i] : 0;
+        if (memory[i] != byte)
         {
-            printf("Opcode not known or not implemented [0x0000]: 0x%X\n", opcode);
-            break;
+            memory[i] = byte;
+            if (runStart < 0)
+                runStart = i;
         }
-        break;
+        else if (runStart >= 0)
+        {
+            invalidateCode(runStart, i - runStart);
+            runStart = -1;
+        }
+        ++i;
     }
+    if (runStart >= 0)
+        invalidateCode(runStart, reach - runStart);
+    if (incomingSize > reach)
+        memcpy(&memory[reach], &incoming[reach], incomingSize - reach);
 
-    if (delayTimer > 0)
-        --delayTimer;
+    //Everything on screen needs drawing again
+    dirtyRows = ~0ull;
+    drawFlag = true;
+#if CHIP8_PROFILE
+    profiler->setCallStack(stack, stackPointer, decodeCache, addressMask);
+#endif
+    return true;
+}
 
-    if (soundTimer > 0)
+bool chip8::saveState(const char * filename) const {
+    chip8Snapshot snapshot;
+    saveState(snapshot);
+
+    FILE * pFile = fopen(filename, "wb");
+    if (pFile == NULL)
     {
-        if (soundTimer == 1)
-        printf("BEEP!\n");
-        --soundTimer;
+        fputs("File error", stderr);
+        return false;
     }
+
+    bool written = fwrite(&snapshot, snapshot.size(), 1, pFile) == 1;
+    fclose(pFile);
+    return written;
 }
 
+bool chip8::loadState(const char * filename) {
+    FILE * pFile = fopen(filename, "rb");
+    if (pFile == NULL)
+    {
+        fputs("File error", stderr);
+        return false;
+    }
 
+    //The header says how much state follows
+    chip8Snapshot snapshot;
+    bool read = fread(&snapshot, offsetof(chip8Snapshot, state), 1, pFile) == 1;
+    if (read && validSnapshotHeader(snapshot))
+        read = fread(&snapshot.state, snapshot.stateSize, 1, pFile) == 1;
+    fclose(pFile);
 
-bool chip8::loadFile(const char * filename){
-    initialize();
-	printf("Loading: %s\n", filename);
-		
-	// Open file
-	FILE * pFile = fopen(filename, "rb");
-	if (pFile == NULL)
-	{
-		fputs ("File error", stderr); 
-		return false;
-	}
-
-	// Check file size
-	fseek(pFile , 0 , SEEK_END);
-	long lSize = ftell(pFile);
-	rewind(pFile);
-	printf("Filesize: %d\n", (int)lSize);
-	
-	// Allocate memory to contain the whole file
-	char * buffer = (char*)malloc(sizeof(char) * lSize);
-	if (buffer == NULL) 
-	{
-		fputs ("Memory error", stderr); 
-		return false;
-	}
-
-	// Copy the file into the buffer
-	size_t result = fread (buffer, 1, lSize, pFile);
-	if (result != lSize) 
-	{
-		fputs("Reading error",stderr); 
-		return false;
-	}
-
-	// Copy buffer to Chip8 memory
-	if((4096-512) > lSize)
-	{
-		for(int i = 0; i < lSize; ++i)
-			memory[i + 512] = buffer[i];
-	}
-	else
-		printf("Error: ROM too big for memory");
-	
-	// Close file, free buffer
-	fclose(pFile);
-	free(buffer);
-
-	return true;
-
-}
\ No newline at end of file
+    if (!read)
+    {
+        fputs("Reading error", stderr);
+        return false;
+    }
+    return loadState(snapshot);
+}
+
+void chip8::unpackDisplay(unsigned char * pixels) const {
+    int width = getDisplayWidth();
+    int height = getDisplayHeight();
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < width; ++x)
+        {
+            int shift = 63 - (x & 63);
+            pixels[y * width + x] = ((display[0][y][x >> 6] >> shift) & 1) | ((display[1][y][x >> 6] >> shift) & 1) << 1;
+        }
+}
+
+unsigned long long chip8::frameHash() const {
+    //Low resolution hashes the same 32 words it always has, word 0 of each row
+    int height = getDisplayHeight();
+    int words = hires ? 2 : 1;
+    uint64_t rows[2 * 64 * 2];
+    uint64_t planeOne = 0;
+    int count = 0;
+    for (int plane = 0; plane < 2; ++plane)
+        for (int y = 0; y < height; ++y)
+            for (int w = 0; w < words; ++w)
+            {
+                rows[count++] = display[plane][y][w];
+                if (plane == 1)
+                    planeOne |= display[plane][y][w];
+            }
+    return hashDisplay(rows, planeOne ? count : count / 2);
+}
+
+double chip8::audioSampleRate(unsigned char pitch) {
+    return 4000.0 * pow(2.0, (pitch - 64) / 48.0);
+}
+
+unsigned long long chip8::hashDisplay(const uint64_t * rows, int count) {
+    unsigned long long hash = 0xCBF29CE484222325ULL;
+    for (int i = 0; i < count; ++i)
+    {
+        hash ^= rows[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
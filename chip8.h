@@ -1,28 +1,379 @@
 #pragma once
 
-class chip8
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include "chip8log.h"
+
+// Dispatch engine used by emulateCycle, pick one at build time with -DCHIP8_DISPATCH=...
+#define CHIP8_DISPATCH_SWITCH 0 // Reference engine, a single switch over the handler index
+#define CHIP8_DISPATCH_TABLE 1  // Indirect call through a table of handler functions
+#define CHIP8_DISPATCH_GOTO 2   // Threaded code using computed goto (GCC/Clang only)
+
+#ifndef CHIP8_DISPATCH
+#define CHIP8_DISPATCH CHIP8_DISPATCH_SWITCH
+#endif
+
+// Build with -DCHIP8_JIT=1 (and chip8jit.cpp) to let emulateCycles run hot blocks as native x86-64
+#ifndef CHIP8_JIT
+#define CHIP8_JIT 0
+#endif
+
+// Build with -DCHIP8_PROFILE=1 (and chip8profile.cpp) to count every instruction, see chip8profile.h
+#ifndef CHIP8_PROFILE
+#define CHIP8_PROFILE 0
+#endif
+
+// Instructions per emulated second unless setClockSpeed says otherwise, what the front end has always run at
+#define CHIP8_DEFAULT_CLOCK 600
+
+// CXNN's seed unless seedRandom says otherwise
+#define CHIP8_DEFAULT_SEED 1
+
+// Behaviours the CHIP-8 interpreters out there disagree on, for setQuirks. With none set the machine runs
+// the way it always has: shifts work on VX in place, FX55/FX65 move I past what they copied, BNNN adds V0,
+// the logic ops leave VF alone and sprites wrap round the edges of the screen
+#define CHIP8_QUIRK_VF_RESET 0x01   // 8XY1, 8XY2 and 8XY3 clear VF
+#define CHIP8_QUIRK_SHIFT_VY 0x02   // 8XY6 and 8XYE shift VY and put the result in VX
+#define CHIP8_QUIRK_KEEP_I 0x04     // FX55 and FX65 leave I where it was
+#define CHIP8_QUIRK_JUMP_VX 0x08    // BNNN jumps to NNN plus VX, X being the top digit of NNN
+#define CHIP8_QUIRK_CLIP 0x10       // Sprites are cut off at the edges instead of wrapping
+#define CHIP8_QUIRK_COMPILED 0x1F   // The quirks the interpreter is instantiated for
+
+// Not a quirk as such but the XO-CHIP extensions: 64 KB of memory, two bitplanes, the audio pattern and the
+// instructions that go with them. It rides along with the quirks so the ROM database, movies and --quirks
+// carry it, but it changes how opcodes decode rather than being compiled in
+#define CHIP8_QUIRK_XO_CHIP 0x20
+#define CHIP8_QUIRK_ALL 0x3F
+
+// Quirks of the interpreters most ROMs were written for. CHIP-48 really moves I by X rather than X + 1
+// in FX55/FX65, the nearest here is moving it by X + 1
+#define CHIP8_VARIANT_COSMAC_VIP (CHIP8_QUIRK_VF_RESET | CHIP8_QUIRK_SHIFT_VY | CHIP8_QUIRK_CLIP)
+#define CHIP8_VARIANT_CHIP48 (CHIP8_QUIRK_JUMP_VX | CHIP8_QUIRK_CLIP)
+#define CHIP8_VARIANT_SUPERCHIP (CHIP8_QUIRK_KEEP_I | CHIP8_QUIRK_JUMP_VX | CHIP8_QUIRK_CLIP)
+#define CHIP8_VARIANT_MODERN (CHIP8_QUIRK_SHIFT_VY)    // Octo and XO-CHIP
+#define CHIP8_VARIANT_XO_CHIP (CHIP8_VARIANT_MODERN | CHIP8_QUIRK_XO_CHIP)
+
+// Bytes of memory there's room for. Without the XO-CHIP extensions only the first 4 KB can be reached
+#define CHIP8_MEMORY_SIZE 0x10000
+
+// Where SUPER-CHIP's 8x10 digits for FX30 sit, straight after the 4x5 ones at 0
+#define CHIP8_BIG_FONT_ADDRESS 0x50
+
+// A set of quirk flags as compile time constants. The interpreter is instantiated once per set, so each
+// quirk is settled when it's compiled and costs nothing per instruction
+template<unsigned int Flags>
+struct chip8QuirkPolicy
+{
+    static const bool vfReset = (Flags & CHIP8_QUIRK_VF_RESET) != 0;
+    static const bool shiftVY = (Flags & CHIP8_QUIRK_SHIFT_VY) != 0;
+    static const bool keepI = (Flags & CHIP8_QUIRK_KEEP_I) != 0;
+    static const bool jumpVX = (Flags & CHIP8_QUIRK_JUMP_VX) != 0;
+    static const bool clip = (Flags & CHIP8_QUIRK_CLIP) != 0;
+};
+
+class chip8Jit;
+class chip8Profiler;
+
+// Every instruction handler, named after the opcode pattern it executes
+#define CHIP8_HANDLER_LIST(X) \
+    X(00E0) X(00EE) \
+    X(00CN) X(00FB) X(00FC) X(00FD) X(00FE) X(00FF) /* SUPER-CHIP scrolling, exit and resolution */ \
+    X(00DN) X(5XY2) X(5XY3) X(F000) X(FN01) X(F002) X(FX3A) /* XO-CHIP */ \
+    X(1NNN) X(2NNN) X(3XNN) X(4XNN) X(5XY0) X(6XNN) X(7XNN) \
+    X(8XY0) X(8XY1) X(8XY2) X(8XY3) X(8XY4) X(8XY5) X(8XY6) X(8XY7) X(8XYE) \
+    X(9XY0) X(ANNN) X(BNNN) X(CXNN) X(DXYN) X(DXY0) \
+    X(EX9E) X(EXA1) \
+    X(FX07) X(FX0A) X(FX15) X(FX18) X(FX1E) X(FX29) X(FX30) X(FX33) X(FX55) X(FX65) X(FX75) X(FX85) \
+    X(UNKNOWN) /* Prints the opcode and stalls on it */ \
+    X(IGNORED) /* Silently stalls on it */
+
+// Handler index for a pre-decoded instruction
+enum chip8Handler : unsigned char
 {
+#define X(name) OP_##name,
+    CHIP8_HANDLER_LIST(X)
+#undef X
+    OP_COUNT
+};
+
+// One instruction with its operands already pulled out of the opcode
+struct decodedInstruction
+{
+    unsigned char handler;
+    unsigned char x;
+    unsigned char y;
+    unsigned char nn;
+    unsigned short nnn;
+    unsigned short opcode;
+    unsigned char skip;     // How far a skip moves PC when it skips: 4, or 6 over an XO-CHIP F000 NNNN
+};
+
+// Everything a running machine is, kept as one plain block so a save state is a single memcpy
+struct chip8State
+{
+    unsigned short opcode;
+    unsigned char cpuRegisters[16];
+    unsigned short indexRegister;
+    unsigned short programCounter;
+    unsigned char delayTimer;
+    unsigned char soundTimer;
+    unsigned short stack[16];
+    unsigned short stackPointer;
+
+    // Screen packed as 128 bit rows, two 64 bit words each, bit 63 of word 0 is the leftmost pixel. The 64x32
+    // low resolution screen is word 0 of rows 0-31 and leaves the rest clear. Each of XO-CHIP's two bitplanes is
+    // a screen of its own, display[plane][y][word], so drawing into either or both is XORs on row words.
+    // Without XO-CHIP everything happens in plane 0
+    uint64_t display[2][64][2];
+    unsigned char currentKey[16];
+
+    // Set by 00FF for SUPER-CHIP's 128x64 screen, cleared by 00FE
+    unsigned char hires;
+
+    // SUPER-CHIP's user flags, FX75 saves V0-VX to them and FX85 loads them back
+    unsigned char flagRegisters[16];
+
+    // Bitplanes drawing, clearing and scrolling work on, bit n for plane n. FN01 sets it, 1 until then
+    unsigned char planeMask;
+
+    // XO-CHIP's sound: a 128 bit pattern played one bit per sample while the sound timer runs, at a rate set
+    // by pitch (see chip8::audioSampleRate). F002 loads the pattern from I and FX3A sets the pitch from VX
+    unsigned char audioPattern[16];
+    unsigned char pitch;
+
+    // Emulated time towards the next 60Hz timer tick, see chip8::advanceClock
+    unsigned long long timerPhase;
+
+    // Instructions run since the ROM was loaded
+    unsigned long long cycleCount;
+
+    // Set while FX0A is halted waiting for a key. PC stays on the FX0A
+    unsigned char waitingForKey;
+
+    // CXNN's xorshift64* generator, never 0
+    uint64_t randomState;
+
+    // Last, so a save state can stop at the end of the memory the machine can reach: the first 4 KB, or
+    // all 64 KB with XO-CHIP
+    unsigned char memory[CHIP8_MEMORY_SIZE];
+};
+
+// Bump whenever chip8State changes shape
+#define CHIP8_SNAPSHOT_VERSION 6
+#define CHIP8_SNAPSHOT_MAGIC 0x53533843 // "C8SS"
+
+// Fixed layout save state, safe to memcpy around or write straight to a file. Only the first stateSize
+// bytes of state are used, everything up to the end of the memory the machine could reach, so without
+// XO-CHIP size() is a few KB and the rest is never copied. Only loads into a build with the same version
+struct chip8Snapshot
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t stateSize;
+    uint32_t reserved;
+    chip8State state;
+
+    // Bytes that matter, header included
+    size_t size() const { return offsetof(chip8Snapshot, state) + stateSize; }
+};
+
+// stateSize of a snapshot with addressMask + 1 bytes of memory
+#define CHIP8_STATE_SIZE(addressMask) (offsetof(chip8State, memory) + (addressMask) + 1)
+
+class chip8 : private chip8State
+{
+    friend class chip8Jit;
+
     private:
-        unsigned short opcode;
-        unsigned char memory[4096];
-        unsigned char cpuRegisters[16];
-        unsigned short indexRegister;
-        unsigned short programCounter;
-        unsigned char delayTimer;
-        unsigned char soundTimer;
-        unsigned short stack[16];
-        unsigned short stackPointer;
-    
+        // Decoded copy of the instruction starting at every address in memory
+        decodedInstruction decodeCache[CHIP8_MEMORY_SIZE];
+
+        void decodeAt(unsigned short address);
+        void decodeAll();
+        void invalidateCode(unsigned short address, unsigned short length);
+
+#define X(name) template<class Quirks> void op##name(const decodedInstruction & d);
+        CHIP8_HANDLER_LIST(X)
+#undef X
+
+        // Emulated time. Every instruction adds 60 to timerPhase and each clockSpeed of it is one 60Hz timer tick
+        unsigned int clockSpeed;
+
+        void tickTimers(unsigned int ticks);
+        void advanceClock(unsigned long cycles);
+
+        // Runs count instructions through the dispatch engine with Quirks compiled in
+        template<class Quirks> void interpretCycles(unsigned long count);
+
+        typedef void (chip8::*interpreterFunction)(unsigned long count);
+        template<size_t... Flags> static interpreterFunction interpreterFor(unsigned int flags, std::index_sequence<Flags...>);
+
+        int idleLoopAt(unsigned short address) const;
+        bool anyKeyDown() const;
+        unsigned long skipIdleLoop(unsigned long budget);
+
+        // Set when the last emulateCycles call ended parked in an idle loop
+        bool idle;
+
+        // Bit n set when row n of display changed since the last takeDirtyRows
+        uint64_t dirtyRows;
+
+        // XORs a sprite 8 (or with wide, 16) pixels across into the screen at its current resolution, sets VF
+        // on collision and marks the rows it touched
+        template<class Quirks> void drawSprite(unsigned char x, unsigned char y, int lines, bool wide);
+
+        // Only created once emulateCycles runs in a CHIP8_JIT build
+        chip8Jit * jit;
+        bool jitEnabled;
+
+        // What initialize starts CXNN's generator from
+        uint64_t randomSeed;
+
+        // CHIP8_QUIRK_* flags. Like clockSpeed it's how the machine is set up, not part of its state
+        unsigned int quirks;
+
+        // Memory that can be reached, 0xFFF or with XO-CHIP 0xFFFF. PC and every address from I wrap round in it
+        unsigned short addressMask;
+
+        // interpretCycles instantiated for quirks
+        interpreterFunction interpreter;
+
+        uint64_t romHash;
+
+        // Unknown opcodes and beeps go here rather than to stdio, chip8Logger writes them out
+        chip8EventRing eventLog;
+
+#if CHIP8_PROFILE
+        chip8Profiler * profiler;
+#endif
+
     public:
         chip8(/* args */);
+        ~chip8();
+
+        chip8(const chip8 &) = delete;
+        chip8 & operator=(const chip8 &) = delete;
 
         void emulateCycle();
+        void emulateCycles(unsigned long count);
         void initialize();
 
+        // Instructions per emulated second (at least 60). This only decides how many instructions make up
+        // a 60Hz timer tick, how fast they actually run is up to whoever calls emulateCycles
+        void setClockSpeed(unsigned int instructionsPerSecond);
+        unsigned int getClockSpeed() const { return clockSpeed; }
+
+        // Instructions run since the ROM was loaded
+        unsigned long long getCycleCount() const { return cycleCount; }
+
+        // CHIP8_QUIRK_* flags (or a CHIP8_VARIANT_*) for the interpreter the ROM was written for, kept across
+        // initialize and loadFile. Switches emulation over to the interpreter built for exactly those quirks
+        void setQuirks(unsigned int flags);
+        unsigned int getQuirks() const { return quirks; }
+
+        // Restarts CXNN's random numbers from seed, now and on every initialize (and so every loadFile) after.
+        // The generator's state is part of chip8State, so save states and rewind carry it along
+        void seedRandom(uint64_t seed);
+        uint64_t getRandomSeed() const { return randomSeed; }
+
+        // In a CHIP8_JIT build, false has emulateCycles interpret everything, to check the JIT against. On by
+        // default, and does nothing in other builds
+        void setJitEnabled(bool enabled) { jitEnabled = enabled; }
+
+        // True when the last emulateCycles finished with the program sitting in a wait loop (jumping to itself,
+        // polling a key or waiting on the delay timer) or halted in FX0A. Those are fast-forwarded rather than run
+        bool isIdle() const { return idle; }
+
+        // Halted in FX0A until a key goes down. No instructions run meanwhile, only the timers count, so the
+        // caller can block until it has input to give
+        bool isWaitingForKey() const { return waitingForKey != 0; }
+
         bool drawFlag;
 
-        unsigned char currentKey[16];
-        unsigned char gfx[64 * 32];
+        using chip8State::currentKey;
+        using chip8State::display;
+
+        // 128x64 after 00FF, 64x32 otherwise. Either way rows are display[plane][y][0] then display[plane][y][1]
+        bool isHires() const { return hires != 0; }
+        int getDisplayWidth() const { return hires ? 128 : 64; }
+        int getDisplayHeight() const { return hires ? 64 : 32; }
+
+        // Returns which rows changed since the last call (bit n for row n at the current resolution, from anything
+        // that draws, scrolls or clears) and clears them and drawFlag. A resolution change marks every row
+        uint64_t takeDirtyRows();
+
+        // Expands display to one byte per pixel, getDisplayWidth() * getDisplayHeight() bytes in rows. Each is the
+        // pixel's bit in plane 0 plus twice its bit in plane 1, so 0 or 1 unless XO-CHIP drew into plane 1
+        void unpackDisplay(unsigned char * pixels) const;
+
+        // XO-CHIP's sound, see chip8State. The pattern starts out silent
+        const unsigned char * getAudioPattern() const { return audioPattern; }
+        unsigned char getPitch() const { return pitch; }
+
+        // Pattern bits played per second at a pitch, 4000Hz at the default of 64 and doubling every 48 above it
+        static double audioSampleRate(unsigned char pitch);
 
         bool loadFile(const char * filename);
+
+        // Resets the machine and copies size bytes of program to 0x200. Fails on more than fits in 64 KB, anything
+        // past 4 KB is only reachable with XO-CHIP
+        bool loadProgram(const unsigned char * data, size_t size);
+
+        // chip8RomHash of the program last loaded, the key to look it up in a chip8RomDatabase
+        uint64_t getRomHash() const { return romHash; }
+
+#if CHIP8_PROFILE
+        // Counts from every instruction run since the machine was created, or since reset on it
+        chip8Profiler & getProfiler() { return *profiler; }
+#endif
+
+        // Save states. Saving and loading are one copy of the state up to the end of the memory that can be
+        // reached, loading also re-decodes memory and marks the whole screen dirty. Loading a snapshot with less
+        // memory than this machine reaches clears the rest. Loads fail on a snapshot from a different version
+        // or layout
+        void saveState(chip8Snapshot & snapshot) const;
+        bool loadState(const chip8Snapshot & snapshot);
+        bool saveState(const char * filename) const;
+        bool loadState(const char * filename);
+
+        // Decodes a single opcode, shared with the other engines so they all agree on what each opcode is.
+        // xoChip decodes XO-CHIP's instructions, otherwise their opcodes mean what they always have
+        static void decode(unsigned short opcode, decodedInstruction & d, bool xoChip = false);
+
+        // One line with PC, I, SP, both timers and V0-VF
+        void dumpRegisters(FILE * out) const;
+
+        // 64 bit FNV-1a of display, for comparing runs without keeping whole frames around. A low resolution
+        // screen hashes as its 32 row words, a high resolution one as all 128 words, followed by plane 1's
+        // the same way whenever it has anything on it
+        unsigned long long frameHash() const;
+        static unsigned long long hashDisplay(const uint64_t * rows, int count = 32);
+
+        // CXNN's generator, shared with the lockstep engine. randomStateFor turns any seed, 0 included, into a
+        // starting state and nextRandom steps it and returns the top byte, every value 0-255 equally likely
+        static uint64_t randomStateFor(uint64_t seed)
+        {
+            //splitmix64 finaliser, so nearby seeds start far apart
+            uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            z ^= z >> 31;
+            return z != 0 ? z : 0x9E3779B97F4A7C15ULL;
+        }
+
+        static unsigned char nextRandom(uint64_t & state)
+        {
+            uint64_t x = state;
+            x ^= x >> 12;
+            x ^= x << 25;
+            x ^= x >> 27;
+            state = x;
+            return (x * 0x2545F4914F6CDD1DULL) >> 56;
+        }
+
+        // XORs an 8 pixel wide sprite from memory into 32 packed 64 pixel rows, wrapping at the edges. Returns true
+        // on collision. The low resolution screen on its own, for the lockstep engine
+        static bool drawSprite(uint64_t * rows, const unsigned char * memory, unsigned short address, unsigned char x, unsigned char y, unsigned char height);
 };
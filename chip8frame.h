@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+// One finished frame as the window needs it, copied out of the machine so the emulation can carry on
+// while it's drawn
+struct chip8Frame
+{
+    uint64_t display[2][64][2];     // Both bitplanes, packed as chip8::display
+    uint64_t dirtyRows;             // Rows that changed since the last frame the reader picked up
+    bool hires;
+};
+
+// Single producer, single consumer triple buffer with no locks. The writer fills back() and publishes it,
+// the reader takes the newest published frame whenever it likes. Neither ever waits on the other: a
+// writer that gets ahead just replaces the frame the reader hasn't taken yet
+template<class T>
+class chip8TripleBuffer
+{
+    private:
+        static const unsigned int FRESH = 4;    // Set on the middle slot when it holds a frame the reader hasn't taken
+
+        T slots[3];
+        std::atomic<unsigned int> middle;       // Slot index, plus FRESH
+        unsigned int backIndex;                 // Only the writer touches this
+        unsigned int frontIndex;                // Only the reader touches this
+
+    public:
+        chip8TripleBuffer() :
+            slots(), middle(1), backIndex(0), frontIndex(2)
+        {
+        }
+
+        chip8TripleBuffer(const chip8TripleBuffer &) = delete;
+        chip8TripleBuffer & operator=(const chip8TripleBuffer &) = delete;
+
+        // Writer side. back() is the writer's own until publish hands it over and gives it another slot,
+        // which still holds whatever frame was last written there
+        T & back() { return slots[backIndex]; }
+
+        // True if the frame this replaced was never taken, so anything the reader needed to know
+        // about it has to be carried into the next one
+        bool publish()
+        {
+            unsigned int previous = middle.exchange(backIndex | FRESH, std::memory_order_acq_rel);
+            backIndex = previous & ~FRESH;
+            return (previous & FRESH) != 0;
+        }
+
+        // Reader side. Swaps in the newest published frame, false (with front() unchanged) if nothing
+        // new has been published since the last time
+        bool acquire()
+        {
+            if ((middle.load(std::memory_order_relaxed) & FRESH) == 0)
+                return false;
+
+            unsigned int previous = middle.exchange(frontIndex, std::memory_order_acq_rel);
+            frontIndex = previous & ~FRESH;
+            return true;
+        }
+
+        const T & front() const { return slots[frontIndex]; }
+};
@@ -0,0 +1,466 @@
+#include "chip8jit.h"
+#include "chip8.h"
+#include <string.h>
+
+#if !defined(__x86_64__) || defined(_WIN32)
+#error "The CHIP-8 JIT only targets x86-64 with the System V calling convention"
+#endif
+
+#include <sys/mman.h>
+
+#define JIT_BUFFER_SIZE (1024 * 1024)
+#define JIT_MAX_BLOCKS 4096
+#define JIT_MAX_BLOCK_INSTRUCTIONS 64
+#define JIT_HOT_THRESHOLD 2
+
+// Worst case bytes for one block, checked before translating so emission never has to
+#define JIT_MAX_BLOCK_BYTES 4096
+
+enum hostRegister
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// Registers a block can keep V0-VF and I in. RAX, RCX and RDX are scratch and RDI holds the chip8 pointer
+static const int allocatable[] = { RSI, R8, R9, R10, R11, RBX, RBP, R12, R13, R14, R15 };
+#define ALLOCATABLE_COUNT (int)(sizeof(allocatable) / sizeof(allocatable[0]))
+#define HOST_I 16 // Slot for the index register, after V0-VF
+
+static bool calleeSaved(int reg) {
+    return reg == RBX || reg == RBP || reg >= R12;
+}
+
+// Just enough of an x86-64 encoder for the ops below. Every value is kept zero extended in a 32 bit register
+struct emitter
+{
+    unsigned char * p;
+
+    enum { ADD = 0x01, OR = 0x09, AND = 0x21, SUB = 0x29, XOR = 0x31, CMP = 0x39, MOV = 0x89, TEST = 0x85 };
+    enum { EXT_ADD = 0, EXT_AND = 4, EXT_SUB = 5, EXT_XOR = 6, EXT_CMP = 7, EXT_SHL = 4, EXT_SHR = 5 };
+    enum { CC_B = 0x2, CC_E = 0x4, CC_NE = 0x5 };
+
+    void byte(unsigned char b) { *p++ = b; }
+    void dword(unsigned int v) { memcpy(p, &v, 4); p += 4; }
+
+    void rex(int reg, int rm, bool force = false) {
+        unsigned char r = 0x40 | ((reg & 8) ? 0x4 : 0) | ((rm & 8) ? 0x1 : 0);
+        if (r != 0x40 || force)
+            byte(r);
+    }
+    void modrm(int mod, int reg, int rm) { byte((mod << 6) | ((reg & 7) << 3) | (rm & 7)); }
+
+    // [rdi + disp32]
+    void memory(int reg, int disp) { modrm(2, reg, RDI); dword(disp); }
+    // [rdi + rcx * scale + disp32]
+    void indexed(int reg, int scaleShift, int disp) {
+        modrm(2, reg, 4);
+        byte((scaleShift << 6) | (RCX << 3) | RDI);
+        dword(disp);
+    }
+
+    void aluRR(unsigned char op, int dst, int src) { rex(src, dst); byte(op); modrm(3, src, dst); }
+    void aluRI(int ext, int dst, unsigned int imm) { rex(0, dst); byte(0x81); modrm(3, ext, dst); dword(imm); }
+    void shiftRI(int ext, int dst, unsigned char amount) { rex(0, dst); byte(0xC1); modrm(3, ext, dst); byte(amount); }
+    void movRR(int dst, int src) { if (dst != src) aluRR(MOV, dst, src); }
+    void movRI(int dst, unsigned int imm) { rex(0, dst); byte(0xB8 + (dst & 7)); dword(imm); }
+    void cmov(int cc, int dst, int src) { rex(dst, src); byte(0x0F); byte(0x40 + cc); modrm(3, dst, src); }
+    void imulRRI(int dst, int src, unsigned char imm) { rex(dst, src); byte(0x6B); modrm(3, dst, src); byte(imm); }
+
+    void loadByte(int dst, int disp) { rex(dst, 0); byte(0x0F); byte(0xB6); memory(dst, disp); }
+    void loadWord(int dst, int disp) { rex(dst, 0); byte(0x0F); byte(0xB7); memory(dst, disp); }
+    void storeByte(int src, int disp) { rex(src, 0, true); byte(0x88); memory(src, disp); }
+    void storeWord(int src, int disp) { byte(0x66); rex(src, 0); byte(0x89); memory(src, disp); }
+
+    void loadByteIndexed(int dst, int disp) { rex(dst, 0); byte(0x0F); byte(0xB6); indexed(dst, 0, disp); }
+    void loadWordIndexed(int dst, int disp) { rex(dst, 0); byte(0x0F); byte(0xB7); indexed(dst, 1, disp); }
+    void storeWordIndexed(int src, int disp) { byte(0x66); rex(src, 0); byte(0x89); indexed(src, 1, disp); }
+
+    void push(int reg) { rex(0, reg); byte(0x50 + (reg & 7)); }
+    void pop(int reg) { rex(0, reg); byte(0x58 + (reg & 7)); }
+    void ret() { byte(0xC3); }
+
+    // eax = condition ? taken : notTaken
+    void select(int cc, unsigned int taken, unsigned int notTaken) {
+        movRI(RAX, notTaken);
+        movRI(RDX, taken);
+        cmov(cc, RAX, RDX);
+    }
+};
+
+enum instructionKind { KIND_NONE, KIND_BODY, KIND_END };
+
+// Which chip8 registers an instruction reads or writes, bit 0-15 for V0-VF and bit 16 for I.
+// Instructions a quirk changes are translated only as they run with no quirks set, otherwise interpreted
+static instructionKind classify(const decodedInstruction & d, unsigned int quirks, unsigned int & uses, unsigned int & writes) {
+    unsigned int x = 1u << d.x, y = 1u << d.y, vf = 1u << 0xF, i = 1u << HOST_I;
+
+    if (((quirks & CHIP8_QUIRK_VF_RESET) && (d.handler == OP_8XY1 || d.handler == OP_8XY2 || d.handler == OP_8XY3)) ||
+        ((quirks & CHIP8_QUIRK_SHIFT_VY) && (d.handler == OP_8XY6 || d.handler == OP_8XYE)) ||
+        ((quirks & CHIP8_QUIRK_JUMP_VX) && d.handler == OP_BNNN))
+    {
+        uses = writes = 0;
+        return KIND_NONE;
+    }
+
+    switch (d.handler) {
+        case OP_6XNN: case OP_7XNN: case OP_FX07:
+            uses = writes = x; return KIND_BODY;
+        case OP_8XY0: case OP_8XY1: case OP_8XY2: case OP_8XY3:
+            uses = x | y; writes = x; return KIND_BODY;
+        case OP_8XY4: case OP_8XY5: case OP_8XY7:
+            uses = x | y | vf; writes = x | vf; return KIND_BODY;
+        case OP_8XY6: case OP_8XYE:
+            uses = x | vf; writes = x | vf; return KIND_BODY;
+        case OP_ANNN:
+            uses = writes = i; return KIND_BODY;
+        case OP_FX1E: case OP_FX29:
+            uses = x | i; writes = i; return KIND_BODY;
+
+        case OP_1NNN: case OP_2NNN: case OP_00EE:
+            uses = writes = 0; return KIND_END;
+        case OP_BNNN:
+            uses = 1; writes = 0; return KIND_END;
+        case OP_3XNN: case OP_4XNN: case OP_EX9E: case OP_EXA1:
+            uses = x; writes = 0; return KIND_END;
+        case OP_5XY0: case OP_9XY0:
+            uses = x | y; writes = 0; return KIND_END;
+
+        default:
+            uses = writes = 0; return KIND_NONE;
+    }
+}
+
+static int popcount(unsigned int v) {
+    int n = 0;
+    for (; v; v &= v - 1)
+        ++n;
+    return n;
+}
+
+chip8Jit::chip8Jit(chip8 & owner) : owner(owner) {
+    codeSize = JIT_BUFFER_SIZE;
+    codeUsed = 0;
+    void * buffer = mmap(0, codeSize, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    codeBuffer = buffer == MAP_FAILED ? 0 : (unsigned char *)buffer;
+
+    blocks = new block[JIT_MAX_BLOCKS];
+    blockCount = 0;
+    memset(blockAt, 0xFF, sizeof(blockAt));
+    memset(hits, 0, sizeof(hits));
+    memset(untranslatable, 0, sizeof(untranslatable));
+    memset(coverage, 0, sizeof(coverage));
+
+    const unsigned char * base = (const unsigned char *)&owner;
+    registersOffset = (int)((const unsigned char *)owner.cpuRegisters - base);
+    indexOffset = (int)((const unsigned char *)&owner.indexRegister - base);
+    stackOffset = (int)((const unsigned char *)owner.stack - base);
+    stackPointerOffset = (int)((const unsigned char *)&owner.stackPointer - base);
+    keysOffset = (int)((const unsigned char *)owner.currentKey - base);
+    delayTimerOffset = (int)((const unsigned char *)&owner.delayTimer - base);
+}
+
+chip8Jit::~chip8Jit() {
+    if (codeBuffer)
+        munmap(codeBuffer, codeSize);
+    delete[] blocks;
+}
+
+void chip8Jit::flush() {
+    codeUsed = 0;
+    blockCount = 0;
+    memset(blockAt, 0xFF, sizeof(blockAt));
+    memset(hits, 0, sizeof(hits));
+    memset(coverage, 0, sizeof(coverage));
+}
+
+void chip8Jit::invalidate(int start, int end) {
+    if (start < 0)
+        start = 0;
+    if (end > 4096)
+        end = 4096;
+
+    bool covered = false;
+    for (int i = start; i < end; ++i)
+    {
+        covered |= coverage[i] != 0;
+        untranslatable[i] = 0;
+        hits[i] = 0;
+    }
+    if (!covered)
+        return;
+
+    for (int i = 0; i < blockCount; ++i)
+    {
+        block & b = blocks[i];
+        if (!b.valid || b.start >= end || b.end <= start)
+            continue;
+
+        b.valid = false;
+        blockAt[b.start] = -1;
+        for (int a = b.start; a < b.end; ++a)
+            --coverage[a];
+    }
+}
+
+bool chip8Jit::translate(unsigned short address) {
+    if (blockCount == JIT_MAX_BLOCKS || codeSize - codeUsed < JIT_MAX_BLOCK_BYTES)
+        flush();
+
+    // First pass picks the instructions and which registers they need
+    const decodedInstruction * decoded = owner.decodeCache;
+    unsigned int used = 0, written = 0;
+    int count = 0;
+    unsigned short pc = address;
+    bool ended = false;
+
+    while (count < JIT_MAX_BLOCK_INSTRUCTIONS && pc + 1 < 4096)
+    {
+        unsigned int uses, writes;
+        instructionKind kind = classify(decoded[pc], owner.quirks, uses, writes);
+        if (kind == KIND_NONE || popcount(used | uses) > ALLOCATABLE_COUNT)
+            break;
+
+        // Where a 60Hz tick falls inside a block depends on the clock phase, so FX07 only ever starts one
+        if (decoded[pc].handler == OP_FX07 && count > 0)
+            break;
+
+        used |= uses;
+        written |= writes;
+        ++count;
+        pc += 2;
+
+        if (kind == KIND_END)
+        {
+            ended = true;
+            break;
+        }
+    }
+
+    if (count == 0)
+        return false;
+
+    int host[17];
+    int next = 0;
+    for (int r = 0; r < 17; ++r)
+        host[r] = (used & (1u << r)) ? allocatable[next++] : -1;
+
+    emitter e;
+    e.p = codeBuffer + codeUsed;
+    unsigned char * entry = e.p;
+
+    for (int r = 0; r < 17; ++r)
+        if (host[r] >= 0 && calleeSaved(host[r]))
+            e.push(host[r]);
+
+    for (int r = 0; r < 16; ++r)
+        if (host[r] >= 0)
+            e.loadByte(host[r], registersOffset + r);
+    if (host[HOST_I] >= 0)
+        e.loadWord(host[HOST_I], indexOffset);
+
+    // Second pass emits them. Anything ending the block leaves the next PC in eax
+    const int vf = host[0xF], regI = host[HOST_I];
+    pc = address;
+    for (int n = 0; n < count; ++n, pc += 2)
+    {
+        const decodedInstruction & d = decoded[pc];
+        const int vx = host[d.x], vy = host[d.y];
+        const unsigned int skipped = (pc + d.skip) & 0xFFFF, following = (pc + 2) & 0xFFFF;
+
+        switch (d.handler) {
+            case OP_6XNN:
+                e.movRI(vx, d.nn);
+                break;
+            case OP_7XNN:
+                e.aluRI(emitter::EXT_ADD, vx, d.nn);
+                e.aluRI(emitter::EXT_AND, vx, 0xFF);
+                break;
+            case OP_8XY0:
+                e.movRR(vx, vy);
+                break;
+            case OP_8XY1:
+                e.aluRR(emitter::OR, vx, vy);
+                break;
+            case OP_8XY2:
+                e.aluRR(emitter::AND, vx, vy);
+                break;
+            case OP_8XY3:
+                e.aluRR(emitter::XOR, vx, vy);
+                break;
+            case OP_8XY4: // Carry goes into VF before the add, same order as the interpreter
+                e.movRR(RAX, vx);
+                e.aluRR(emitter::ADD, RAX, vy);
+                e.shiftRI(emitter::EXT_SHR, RAX, 8);
+                e.movRR(vf, RAX);
+                e.aluRR(emitter::ADD, vx, vy);
+                e.aluRI(emitter::EXT_AND, vx, 0xFF);
+                break;
+            case OP_8XY5: // VF = no borrow, taken from the sign of the 32 bit difference
+                e.movRR(RAX, vx);
+                e.aluRR(emitter::SUB, RAX, vy);
+                e.shiftRI(emitter::EXT_SHR, RAX, 31);
+                e.aluRI(emitter::EXT_XOR, RAX, 1);
+                e.movRR(vf, RAX);
+                e.aluRR(emitter::SUB, vx, vy);
+                e.aluRI(emitter::EXT_AND, vx, 0xFF);
+                break;
+            case OP_8XY6: // VF before the shift, same order as the interpreter, so 8FY6 leaves the shifted value
+                e.movRR(RAX, vx);
+                e.aluRI(emitter::EXT_AND, RAX, 1);
+                e.movRR(vf, RAX);
+                e.shiftRI(emitter::EXT_SHR, vx, 1);
+                break;
+            case OP_8XY7:
+                e.movRR(RAX, vy);
+                e.aluRR(emitter::SUB, RAX, vx);
+                e.shiftRI(emitter::EXT_SHR, RAX, 31);
+                e.aluRI(emitter::EXT_XOR, RAX, 1);
+                e.movRR(vf, RAX);
+                e.movRR(RAX, vy);
+                e.aluRR(emitter::SUB, RAX, vx);
+                e.aluRI(emitter::EXT_AND, RAX, 0xFF);
+                e.movRR(vx, RAX);
+                break;
+            case OP_8XYE:
+                e.movRR(RAX, vx);
+                e.shiftRI(emitter::EXT_SHR, RAX, 7);
+                e.movRR(vf, RAX);
+                e.shiftRI(emitter::EXT_SHL, vx, 1);
+                e.aluRI(emitter::EXT_AND, vx, 0xFF);
+                break;
+            case OP_ANNN:
+                e.movRI(regI, d.nnn);
+                break;
+            case OP_FX1E:
+                e.aluRR(emitter::ADD, regI, vx);
+                e.aluRI(emitter::EXT_AND, regI, 0xFFFF);
+                break;
+            case OP_FX29:
+                e.imulRRI(regI, vx, 5);
+                break;
+            case OP_FX07: // Always first in the block, so the timer is exactly what the interpreter would see
+                e.loadByte(RAX, delayTimerOffset);
+                e.movRR(vx, RAX);
+                break;
+
+            case OP_1NNN:
+                e.movRI(RAX, d.nnn);
+                break;
+            case OP_2NNN:
+                e.loadWord(RCX, stackPointerOffset);
+                e.movRI(RAX, following);
+                e.storeWordIndexed(RAX, stackOffset);
+                e.aluRI(emitter::EXT_ADD, RCX, 1);
+                e.storeWord(RCX, stackPointerOffset);
+                e.movRI(RAX, d.nnn);
+                break;
+            case OP_00EE:
+                e.loadWord(RCX, stackPointerOffset);
+                e.aluRI(emitter::EXT_SUB, RCX, 1);
+                e.aluRI(emitter::EXT_AND, RCX, 0xFFFF);
+                e.storeWord(RCX, stackPointerOffset);
+                e.loadWordIndexed(RAX, stackOffset);
+                break;
+            case OP_BNNN:
+                e.movRR(RAX, host[0]);
+                e.aluRI(emitter::EXT_ADD, RAX, d.nnn);
+                break;
+            case OP_3XNN:
+                e.aluRI(emitter::EXT_CMP, vx, d.nn);
+                e.select(emitter::CC_E, skipped, following);
+                break;
+            case OP_4XNN:
+                e.aluRI(emitter::EXT_CMP, vx, d.nn);
+                e.select(emitter::CC_NE, skipped, following);
+                break;
+            case OP_5XY0:
+                e.aluRR(emitter::CMP, vx, vy);
+                e.select(emitter::CC_E, skipped, following);
+                break;
+            case OP_9XY0:
+                e.aluRR(emitter::CMP, vx, vy);
+                e.select(emitter::CC_NE, skipped, following);
+                break;
+            case OP_EX9E:
+            case OP_EXA1:
+                e.movRR(RCX, vx);
+                e.loadByteIndexed(RCX, keysOffset);
+                e.aluRR(emitter::TEST, RCX, RCX);
+                e.select(d.handler == OP_EX9E ? emitter::CC_NE : emitter::CC_E, skipped, following);
+                break;
+        }
+    }
+
+    if (!ended)
+        e.movRI(RAX, pc);
+
+    for (int r = 0; r < 16; ++r)
+        if (written & (1u << r))
+            e.storeByte(host[r], registersOffset + r);
+    if (written & (1u << HOST_I))
+        e.storeWord(regI, indexOffset);
+
+    for (int r = 16; r >= 0; --r)
+        if (host[r] >= 0 && calleeSaved(host[r]))
+            e.pop(host[r]);
+    e.ret();
+
+    codeUsed += e.p - entry;
+
+    block & b = blocks[blockCount];
+    b.code = entry;
+    b.start = address;
+    b.end = pc;
+    b.count = count;
+    b.lastOpcode = decoded[pc - 2].opcode;
+    b.valid = true;
+    blockAt[address] = blockCount++;
+
+    for (int a = b.start; a < b.end; ++a)
+        ++coverage[a];
+
+    return true;
+}
+
+unsigned long chip8Jit::run(unsigned long budget) {
+    if (codeBuffer == 0)
+        return 0;
+
+    //Keep chaining from one block into the next until we hit something that has to be interpreted
+    unsigned long ran = 0;
+    for (;;)
+    {
+        unsigned short pc = owner.programCounter;
+        if (pc >= 4096)
+            break;
+
+        int index = blockAt[pc];
+        if (index < 0)
+        {
+            if (untranslatable[pc] || ++hits[pc] < JIT_HOT_THRESHOLD)
+                break;
+
+            hits[pc] = 0;
+            if (!translate(pc))
+            {
+                untranslatable[pc] = 1;
+                break;
+            }
+            index = blockAt[pc];
+        }
+
+        const block & b = blocks[index];
+        if (b.count > budget - ran)
+            break;
+
+        owner.programCounter = ((blockFunction)b.code)(&owner);
+        owner.opcode = b.lastOpcode;
+        ran += b.count;
+
+        // Nothing in a block touches the timers besides FX07 reading them, so catch them up in one go
+        owner.advanceClock(b.count);
+    }
+
+    return ran;
+}
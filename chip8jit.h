@@ -0,0 +1,59 @@
+#pragma once
+
+class chip8;
+
+// Tier-2 engine behind chip8::emulateCycles (build with -DCHIP8_JIT=1)
+// Hot basic blocks are translated to native x86-64 in an mmap'd buffer, with the V registers
+// and I living in host registers for the length of the block. Anything the translator doesn't
+// handle (drawing, memory writes, timers other than FX07...) ends the block and is interpreted.
+class chip8Jit
+{
+    private:
+        struct block
+        {
+            unsigned char * code;
+            unsigned short start;
+            unsigned short end;         // One past the last byte of the last instruction
+            unsigned short count;       // Instructions executed every time the block runs
+            unsigned short lastOpcode;
+            bool valid;
+        };
+
+        typedef unsigned int (*blockFunction)(chip8 * self);
+
+        chip8 & owner;
+
+        unsigned char * codeBuffer;
+        unsigned long codeSize;
+        unsigned long codeUsed;
+
+        block * blocks;
+        int blockCount;
+
+        short blockAt[4096];            // Index into blocks for every start address, or -1
+        unsigned char hits[4096];       // Times a cold address was reached before translating it
+        unsigned char untranslatable[4096];
+        unsigned short coverage[4096];  // Number of live blocks covering each byte of memory
+
+        // Where the translated code finds the chip8 fields, relative to the object
+        int registersOffset;
+        int indexOffset;
+        int stackOffset;
+        int stackPointerOffset;
+        int keysOffset;
+        int delayTimerOffset;
+
+        bool translate(unsigned short address);
+        void flush();
+
+    public:
+        chip8Jit(chip8 & owner);
+        ~chip8Jit();
+
+        // Runs the translated block at the current PC if it fits in budget and returns how many
+        // instructions it executed, 0 means the caller should interpret the next instruction
+        unsigned long run(unsigned long budget);
+
+        // Drops every block overlapping [start, end), called whenever the program writes to memory
+        void invalidate(int start, int end);
+};
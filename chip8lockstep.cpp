@@ -0,0 +1,437 @@
+#include "chip8lockstep.h"
+#include "chip8rom.h"
+#include <string.h>
+#include <algorithm>
+
+extern unsigned char chip8_fontset[80];
+extern unsigned char chip8_bigfontset[160];
+
+// Every op below is a loop over the lanes in set, written without branches where the interpreter
+// has them so that over a laneRange it vectorises
+#define LANES for (int i = 0, l; i < set.count && (l = set[i], true); ++i)
+
+chip8Lockstep::chip8Lockstep(int lanes) :
+    lanes(lanes),
+    registers(16 * lanes), indexRegister(lanes), programCounter(lanes),
+    delayTimer(lanes), soundTimer(lanes), stack(16 * lanes), stackPointer(lanes),
+    memory(4096 * lanes), gfx(32 * lanes), keys(16 * lanes), superChip(lanes),
+    randomState(lanes, chip8::randomStateFor(CHIP8_DEFAULT_SEED)), randomSeed(lanes, CHIP8_DEFAULT_SEED),
+    decoded(4096), order(lanes), laneBucket(lanes), bucketStart(lanes + 1), stepStamp(0),
+    clockSpeed(CHIP8_DEFAULT_CLOCK), timerPhase(0), cycleCount(0)
+{
+    memset(written, 0, sizeof(written));
+    memset(bucketStamp, 0, sizeof(bucketStamp));
+    for (int a = 0; a < 4096; ++a)
+        chip8::decode(0, decoded[a]);
+}
+
+bool chip8Lockstep::loadFile(const char * filename) {
+    chip8RomFile rom;
+    if (!rom.open(filename))
+    {
+        fputs("File error", stderr);
+        return false;
+    }
+    return loadProgram(rom.data(), rom.size());
+}
+
+bool chip8Lockstep::loadProgram(const unsigned char * data, size_t size) {
+    if (size > 4096 - 512)
+    {
+        fputs("Error: ROM too big for memory\n", stderr);
+        return false;
+    }
+
+    // Memory starts out the same as chip8's, both fonts included
+    for (int l = 0; l < lanes; ++l)
+    {
+        unsigned char * laneMemory = &memory[l * 4096];
+        memset(laneMemory, 0, 4096);
+        memcpy(laneMemory, chip8_fontset, 80);
+        memcpy(laneMemory + CHIP8_BIG_FONT_ADDRESS, chip8_bigfontset, 160);
+        memcpy(laneMemory + 512, data, size);
+    }
+
+    std::fill(registers.begin(), registers.end(), 0);
+    std::fill(indexRegister.begin(), indexRegister.end(), 0);
+    std::fill(programCounter.begin(), programCounter.end(), 0x200);
+    std::fill(delayTimer.begin(), delayTimer.end(), 0);
+    std::fill(soundTimer.begin(), soundTimer.end(), 0);
+    std::fill(stack.begin(), stack.end(), 0);
+    std::fill(stackPointer.begin(), stackPointer.end(), 0);
+    std::fill(gfx.begin(), gfx.end(), 0);
+    std::fill(keys.begin(), keys.end(), 0);
+    std::fill(superChip.begin(), superChip.end(), 0);
+    memset(written, 0, sizeof(written));
+    for (int a = 0; a < 4096; ++a)
+        chip8::decode(fetch(0, a), decoded[a]);
+    timerPhase = 0;
+    cycleCount = 0;
+    for (int l = 0; l < lanes; ++l)
+        randomState[l] = chip8::randomStateFor(randomSeed[l]);
+    return true;
+}
+
+unsigned short chip8Lockstep::fetch(int lane, unsigned short pc) const {
+    const unsigned char * laneMemory = &memory[lane * 4096];
+    unsigned short address = pc & 0x0FFF;
+    return laneMemory[address] << 8 | (address + 1 < 4096 ? laneMemory[address + 1] : 0);
+}
+
+template<class Lanes>
+void chip8Lockstep::execute(const decodedInstruction & d, Lanes set) {
+    // Plain pointers for the loops. Going through the vectors every iteration stops them vectorising,
+    // since any unsigned char store could alias the vectors' own data pointers
+    unsigned char * regs = &registers[0];
+    unsigned char * vx = regs + d.x * lanes;
+    unsigned char * vy = regs + d.y * lanes;
+    unsigned char * vf = regs + 0xF * lanes;
+    unsigned short * __restrict pc = &programCounter[0];
+    unsigned short * __restrict index = &indexRegister[0];
+    unsigned char * __restrict delay = &delayTimer[0];
+    unsigned char * __restrict sound = &soundTimer[0];
+    uint64_t * __restrict rng = &randomState[0];
+    unsigned short * __restrict stk = &stack[0];
+    unsigned short * __restrict sp = &stackPointer[0];
+    unsigned char * __restrict mem = &memory[0];
+    uint64_t * __restrict screen = &gfx[0];
+    const unsigned char * __restrict key = &keys[0];
+
+    switch (d.handler) {
+        case OP_00E0:
+            LANES memset(&screen[l * 32], 0, 32 * sizeof(uint64_t));
+            LANES pc[l] += 2;
+            break;
+        case OP_00EE:
+            LANES
+            {
+                sp[l] = (sp[l] - 1) & 0xFFFF;
+                pc[l] = stk[(sp[l] & 0xF) * lanes + l];
+            }
+            break;
+        case OP_1NNN:
+            LANES pc[l] = d.nnn;
+            break;
+        case OP_2NNN:
+            LANES
+            {
+                stk[(sp[l] & 0xF) * lanes + l] = pc[l] + 2;
+                ++sp[l];
+                pc[l] = d.nnn;
+            }
+            break;
+        case OP_3XNN:
+            LANES pc[l] += vx[l] == d.nn ? 4 : 2;
+            break;
+        case OP_4XNN:
+            LANES pc[l] += vx[l] != d.nn ? 4 : 2;
+            break;
+        case OP_5XY0:
+            LANES pc[l] += vx[l] == vy[l] ? 4 : 2;
+            break;
+        case OP_6XNN:
+            LANES vx[l] = d.nn;
+            LANES pc[l] += 2;
+            break;
+        case OP_7XNN:
+            LANES vx[l] += d.nn;
+            LANES pc[l] += 2;
+            break;
+        case OP_8XY0:
+            LANES vx[l] = vy[l];
+            LANES pc[l] += 2;
+            break;
+        case OP_8XY1:
+            LANES vx[l] |= vy[l];
+            LANES pc[l] += 2;
+            break;
+        case OP_8XY2:
+            LANES vx[l] &= vy[l];
+            LANES pc[l] += 2;
+            break;
+        case OP_8XY3:
+            LANES vx[l] ^= vy[l];
+            LANES pc[l] += 2;
+            break;
+
+        // VF is written before VX is, the order chip8's handlers use with no quirks set. With X as F the result
+        // overwrites the flag (8FF6 leaves the shifted value), with Y as F the op reads the flag just written
+        case OP_8XY4:
+            LANES
+            {
+                vf[l] = vy[l] > 0xFF - vx[l];
+                vx[l] += vy[l];
+            }
+            LANES pc[l] += 2;
+            break;
+        case OP_8XY5:
+            LANES
+            {
+                vf[l] = !(vy[l] > vx[l]);
+                vx[l] -= vy[l];
+            }
+            LANES pc[l] += 2;
+            break;
+        case OP_8XY6:
+            LANES
+            {
+                vf[l] = vx[l] & 0x1;
+                vx[l] >>= 1;
+            }
+            LANES pc[l] += 2;
+            break;
+        case OP_8XY7:
+            LANES
+            {
+                vf[l] = !(vy[l] < vx[l]);
+                vx[l] = vy[l] - vx[l];
+            }
+            LANES pc[l] += 2;
+            break;
+        case OP_8XYE:
+            LANES
+            {
+                vf[l] = vx[l] >> 7;
+                vx[l] <<= 1;
+            }
+            LANES pc[l] += 2;
+            break;
+
+        case OP_9XY0:
+            LANES pc[l] += vx[l] != vy[l] ? 4 : 2;
+            break;
+        case OP_ANNN:
+            LANES index[l] = d.nnn;
+            LANES pc[l] += 2;
+            break;
+        case OP_BNNN:
+            LANES pc[l] = d.nnn + regs[l];
+            break;
+        case OP_CXNN:
+            LANES vx[l] = chip8::nextRandom(rng[l]) & d.nn;
+            LANES pc[l] += 2;
+            break;
+        case OP_DXYN:
+            LANES vf[l] = chip8::drawSprite(&screen[l * 32], &mem[l * 4096], index[l], vx[l], vy[l], d.nn & 0xF);
+            LANES pc[l] += 2;
+            break;
+        case OP_EX9E:
+            LANES pc[l] += key[l * 16 + (vx[l] & 0xF)] != 0 ? 4 : 2;
+            break;
+        case OP_EXA1:
+            LANES pc[l] += key[l * 16 + (vx[l] & 0xF)] == 0 ? 4 : 2;
+            break;
+        case OP_FX07:
+            LANES vx[l] = delay[l];
+            LANES pc[l] += 2;
+            break;
+        case OP_FX0A:
+            // Lanes still waiting stay on this instruction, same as chip8
+            LANES
+            {
+                int pressed = -1;
+                for (int i = 0; i < 16; ++i)
+                    if (key[l * 16 + i] != 0)
+                        pressed = i;
+
+                if (pressed < 0)
+                    continue;
+
+                vx[l] = pressed;
+                pc[l] += 2;
+            }
+            break;
+        case OP_FX15:
+            LANES delay[l] = vx[l];
+            LANES pc[l] += 2;
+            break;
+        case OP_FX18:
+            LANES sound[l] = vx[l];
+            LANES pc[l] += 2;
+            break;
+        case OP_FX1E:
+            LANES index[l] += vx[l];
+            LANES pc[l] += 2;
+            break;
+        case OP_FX29:
+            LANES index[l] = vx[l] * 0x5;
+            LANES pc[l] += 2;
+            break;
+        case OP_FX33:
+            LANES
+            {
+                unsigned char * laneMemory = &mem[l * 4096];
+                for (int i = 0; i < 3; ++i)
+                    written[(index[l] + i) & 0x0FFF] = 1;
+                laneMemory[index[l] & 0x0FFF] = vx[l] / 100;
+                laneMemory[(index[l] + 1) & 0x0FFF] = (vx[l] / 10) % 10;
+                laneMemory[(index[l] + 2) & 0x0FFF] = vx[l] % 10;
+            }
+            LANES pc[l] += 2;
+            break;
+        case OP_FX55:
+            LANES
+            {
+                unsigned char * laneMemory = &mem[l * 4096];
+                for (int i = 0; i <= d.x; ++i)
+                {
+                    written[(index[l] + i) & 0x0FFF] = 1;
+                    laneMemory[(index[l] + i) & 0x0FFF] = regs[i * lanes + l];
+                }
+                index[l] += d.x + 1;
+            }
+            LANES pc[l] += 2;
+            break;
+        case OP_FX65:
+            LANES
+            {
+                const unsigned char * laneMemory = &mem[l * 4096];
+                for (int i = 0; i <= d.x; ++i)
+                    regs[i * lanes + l] = laneMemory[(index[l] + i) & 0x0FFF];
+                index[l] += d.x + 1;
+            }
+            LANES pc[l] += 2;
+            break;
+        // The lanes only have the 64x32 screen, so SUPER-CHIP's instructions stall like unknown ones
+        case OP_00CN: case OP_00FB: case OP_00FC: case OP_00FD: case OP_00FE: case OP_00FF:
+        case OP_DXY0: case OP_FX30: case OP_FX75: case OP_FX85:
+            LANES superChip[l] = 1;
+            LANES eventLog.push(CHIP8_EVENT_UNKNOWN_OPCODE, pc[l], d.opcode, cycleCount);
+            break;
+        case OP_UNKNOWN:
+            LANES eventLog.push(CHIP8_EVENT_UNKNOWN_OPCODE, pc[l], d.opcode, cycleCount);
+            break;
+        default:
+            break;
+    }
+}
+
+// Every lane has run the same number of instructions, so one clock phase covers them all
+void chip8Lockstep::advanceClock() {
+    ++cycleCount;
+    timerPhase += 60;
+    if (timerPhase < clockSpeed)
+        return;
+    timerPhase -= clockSpeed;
+
+    unsigned char * __restrict delay = &delayTimer[0];
+    unsigned char * __restrict sound = &soundTimer[0];
+
+    // Every lane about to beep logs the same event chip8::tickTimers does. Once a tick, so a plain loop is fine
+    for (int l = 0; l < lanes; ++l)
+    {
+        if (sound[l] == 1)
+            eventLog.push(CHIP8_EVENT_BEEP, programCounter[l], 0, cycleCount);
+    }
+
+    for (int l = 0; l < lanes; ++l)
+    {
+        delay[l] = delay[l] > 0 ? delay[l] - 1 : 0;
+        sound[l] = sound[l] > 0 ? sound[l] - 1 : 0;
+    }
+}
+
+void chip8Lockstep::setClockSpeed(unsigned int instructionsPerSecond) {
+    clockSpeed = instructionsPerSecond < 60 ? 60 : instructionsPerSecond;
+    timerPhase %= clockSpeed;
+}
+
+void chip8Lockstep::seedRandom(int lane, uint64_t seed) {
+    randomSeed[lane] = seed;
+    randomState[lane] = chip8::randomStateFor(seed);
+}
+
+// A bucket's lanes are in ascending order, so when there's no gap between them they run as a range
+void chip8Lockstep::executeBucket(const decodedInstruction & d, int begin, int end) {
+    int count = end - begin;
+    if (order[end - 1] - order[begin] == count - 1)
+        execute(d, laneRange{ order[begin], count });
+    else
+        execute(d, laneList{ &order[begin], count });
+}
+
+void chip8Lockstep::step() {
+    // Common case first, every lane on the same PC checked with one vectorised pass
+    unsigned short pc = programCounter[0];
+    unsigned short spread = 0;
+    for (int l = 0; l < lanes; ++l)
+        spread |= programCounter[l] ^ pc;
+
+    if (spread == 0 && sharedCode(pc))
+    {
+        execute(decoded[pc & 0x0FFF], laneRange{ 0, lanes });
+        advanceClock();
+        return;
+    }
+
+    // Otherwise bucket the lanes by PC, wherever they sit, with a counting sort that keeps each bucket's
+    // lanes in order. Addresses are stamped rather than cleared for every step
+    if (++stepStamp == 0)
+    {
+        memset(bucketStamp, 0, sizeof(bucketStamp));
+        stepStamp = 1;
+    }
+    int buckets = 0;
+    for (int l = 0; l < lanes; ++l)
+    {
+        int address = programCounter[l] & 0x0FFF;
+        if (bucketStamp[address] != stepStamp)
+        {
+            bucketStamp[address] = stepStamp;
+            bucketAt[address] = buckets;
+            bucketStart[buckets++] = 0;
+        }
+        laneBucket[l] = bucketAt[address];
+        ++bucketStart[laneBucket[l]];
+    }
+    for (int b = 0, start = 0; b <= buckets; ++b)
+    {
+        int size = b < buckets ? bucketStart[b] : 0;
+        bucketStart[b] = start;
+        start += size;
+    }
+    for (int l = 0; l < lanes; ++l)
+        order[bucketStart[laneBucket[l]]++] = l;
+
+    // Filling in order moved every start on to the next bucket's
+    for (int b = 0, begin = 0; b < buckets; begin = bucketStart[b++])
+    {
+        int end = bucketStart[b];
+        pc = programCounter[order[begin]] & 0x0FFF;
+        if (sharedCode(pc))
+        {
+            executeBucket(decoded[pc], begin, end);
+            continue;
+        }
+
+        // Code some lane has written over can differ between lanes, so split again by opcode
+        decodedInstruction d;
+        while (begin < end)
+        {
+            unsigned short opcode = fetch(order[begin], pc);
+            int * split = std::stable_partition(&order[begin], &order[0] + end,
+                [&](int l) { return fetch(l, pc) == opcode; });
+            int next = (int)(split - &order[0]);
+
+            chip8::decode(opcode, d);
+            executeBucket(d, begin, next);
+            begin = next;
+        }
+    }
+    advanceClock();
+}
+
+void chip8Lockstep::emulateCycles(unsigned long count) {
+    while (count-- > 0)
+        step();
+}
+
+void chip8Lockstep::dumpRegisters(int lane, FILE * out) const {
+    fprintf(out, "PC=%03X I=%03X SP=%X DT=%02X ST=%02X V=", programCounter[lane], indexRegister[lane], stackPointer[lane], delayTimer[lane], soundTimer[lane]);
+    for (int i = 0; i < 16; ++i)
+        fprintf(out, "%02X", registers[i * lanes + lane]);
+}
+
+unsigned long long chip8Lockstep::frameHash(int lane) const {
+    return chip8::hashDisplay(&gfx[lane * 32]);
+}
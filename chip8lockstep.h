@@ -0,0 +1,114 @@
+#pragma once
+
+#include "chip8.h"
+#include <stdio.h>
+#include <vector>
+
+// Runs many copies of the same ROM side by side, for sweeps over inputs and fuzzing.
+// Machine state is stored as structure-of-arrays (one array per register, indexed by lane),
+// so every lane sitting on the same instruction is executed by one loop over contiguous
+// lane arrays, which the compiler turns into AVX2/AVX-512 code (build with -O3 -mavx2 or
+// -march=native). Lanes that have drifted onto different PCs are bucketed by PC each step,
+// and every bucket runs its instruction once, decoded from a cache shared by all lanes. It pays
+// off once there are more lanes than paths they take; a few lanes spread over as many PCs run
+// slower than chip8 would. Same semantics as chip8::emulateCycle with no quirks set, for
+// plain CHIP-8 programs: SUPER-CHIP instructions stall a lane as if they were unknown.
+// chip8-bench --lockstep N checks every lane against a chip8 run one at a time, and times both.
+// A lane that has stalled on a SUPER-CHIP instruction is flagged, since chip8 would have run it.
+class chip8Lockstep
+{
+    private:
+        int lanes;
+
+        // Register r of lane l lives at registers[r * lanes + l], same for stack
+        std::vector<unsigned char> registers;
+        std::vector<unsigned short> indexRegister;
+        std::vector<unsigned short> programCounter;
+        std::vector<unsigned char> delayTimer;
+        std::vector<unsigned char> soundTimer;
+        std::vector<unsigned short> stack;
+        std::vector<unsigned short> stackPointer;
+
+        // Per lane blocks, lane l starts at l * 4096, l * 32 and l * 16. gfx is packed rows like chip8::display
+        std::vector<unsigned char> memory;
+        std::vector<uint64_t> gfx;
+        std::vector<unsigned char> keys;
+        std::vector<unsigned char> superChip;   // Set once a lane has stalled on a SUPER-CHIP instruction
+
+        // CXNN's generator for each lane, and the seed loadFile restarts it from
+        std::vector<uint64_t> randomState;
+        std::vector<uint64_t> randomSeed;
+
+        // Set for any address some lane has written to since loading. Until then every lane
+        // has the same bytes there and we can skip comparing opcodes between lanes
+        unsigned char written[4096];
+
+        // Every address decoded from the ROM as loaded, good wherever written isn't set
+        std::vector<decodedInstruction> decoded;
+
+        // Scratch for step's buckets: lanes in order bucket by bucket, each bucket's first entry in
+        // bucketStart, and for every address the bucket it got on the step bucketStamp says
+        std::vector<int> order;
+        std::vector<int> laneBucket;
+        std::vector<int> bucketStart;
+        int bucketAt[4096];
+        unsigned int bucketStamp[4096];
+        unsigned int stepStamp;
+
+        // The lanes an instruction runs on, every lane from first or a list of them. execute is
+        // instantiated for both, a range being what lets its loops vectorise
+        struct laneRange
+        {
+            int first;
+            int count;
+            int operator[](int i) const { return first + i; }
+        };
+        struct laneList
+        {
+            const int * lanes;
+            int count;
+            int operator[](int i) const { return lanes[i]; }
+        };
+
+        // Shared emulated clock, see chip8::advanceClock. The timers tick for every lane at once
+        unsigned int clockSpeed;
+        unsigned int timerPhase;
+        unsigned long long cycleCount;
+        void advanceClock();
+
+        // Unknown opcodes and beeps from every lane, written out by chip8Logger like a chip8's
+        chip8EventRing eventLog;
+
+        unsigned short fetch(int lane, unsigned short pc) const;
+        bool sharedCode(unsigned short pc) const { return !written[pc & 0x0FFF] && !written[(pc + 1) & 0x0FFF]; }
+        template<class Lanes> void execute(const decodedInstruction & d, Lanes set);
+        void executeBucket(const decodedInstruction & d, int begin, int end);
+        void step();
+
+    public:
+        chip8Lockstep(int lanes);
+
+        int laneCount() const { return lanes; }
+
+        // Loads the same ROM into every lane and resets them all. Fails on more than fits in 4 KB
+        bool loadFile(const char * filename);
+        bool loadProgram(const unsigned char * data, size_t size);
+
+        void emulateCycles(unsigned long count);
+
+        // Same as chip8::setClockSpeed, for every lane
+        void setClockSpeed(unsigned int instructionsPerSecond);
+
+        // Same as chip8::seedRandom, for one lane. Every lane starts on CHIP8_DEFAULT_SEED
+        void seedRandom(int lane, uint64_t seed);
+
+        unsigned char * currentKey(int lane) { return &keys[lane * 16]; }
+        const uint64_t * laneGfx(int lane) const { return &gfx[lane * 32]; }
+
+        // True if the lane has stopped on a SUPER-CHIP instruction since loading, where chip8 would carry on
+        bool stalledOnSuperChip(int lane) const { return superChip[lane] != 0; }
+
+        // Same output as the chip8 versions, for comparing a lane against a normal instance
+        void dumpRegisters(int lane, FILE * out) const;
+        unsigned long long frameHash(int lane) const;
+};
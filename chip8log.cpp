@@ -0,0 +1,215 @@
+#include "chip8log.h"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define LOG_DRAIN_INTERVAL std::chrono::milliseconds(10)
+
+chip8EventRing::chip8EventRing() :
+    head(0), tail(0), droppedCount(0)
+{
+    chip8Logger::attach(this);
+}
+
+chip8EventRing::~chip8EventRing() {
+    chip8Logger::detach(this);
+}
+
+bool chip8EventRing::pop(chip8Event & e) {
+    unsigned long t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire))
+        return false;
+
+    e = events[t & (CHIP8_EVENT_RING_SIZE - 1)];
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+}
+
+namespace {
+
+struct attachedRing
+{
+    chip8EventRing * ring;
+    unsigned long long reportedDrops;
+};
+
+// Everything behind chip8Logger. Built the first time a ring attaches, which is before that ring's owner
+// finishes constructing, so it's torn down after every machine that used it
+struct loggerState
+{
+    std::mutex lock;
+    std::condition_variable wake;
+    std::thread thread;
+    bool stopping;
+
+    std::vector<attachedRing> rings;
+    FILE * sink;
+
+    unsigned int rateLimit;
+    std::chrono::steady_clock::time_point windowStart;
+    unsigned int windowLines;
+    unsigned long long windowSuppressed;
+
+    chip8Logger::counters totals;
+    unsigned long long detachedDrops;
+
+    loggerState() :
+        stopping(false), sink(stdout), rateLimit(1000), windowStart(std::chrono::steady_clock::now()),
+        windowLines(0), windowSuppressed(0), detachedDrops(0)
+    {
+        totals.written = totals.suppressed = totals.dropped = 0;
+        thread = std::thread(&loggerState::run, this);
+    }
+
+    ~loggerState()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        thread.join();
+
+        std::lock_guard<std::mutex> guard(lock);
+        drainAll();
+        reportSuppressed();
+        fflush(sink);
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        while (!stopping)
+        {
+            drainAll();
+            fflush(sink);
+            wake.wait_for(guard, LOG_DRAIN_INTERVAL);
+        }
+    }
+
+    void reportSuppressed()
+    {
+        if (windowSuppressed == 0)
+            return;
+        fprintf(sink, "chip8: %llu events suppressed by the log rate limit\n", windowSuppressed);
+        windowSuppressed = 0;
+    }
+
+    void write(const chip8Event & e)
+    {
+        if (rateLimit > 0)
+        {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (now - windowStart >= std::chrono::seconds(1))
+            {
+                reportSuppressed();
+                windowStart = now;
+                windowLines = 0;
+            }
+
+            if (windowLines >= rateLimit)
+            {
+                ++windowSuppressed;
+                ++totals.suppressed;
+                return;
+            }
+            ++windowLines;
+        }
+
+        switch (e.type)
+        {
+            case CHIP8_EVENT_UNKNOWN_OPCODE:
+                fprintf(sink, "Opcode not known or not implemented [0x0000]: 0x%X at PC %03X, cycle %llu\n", e.opcode, e.pc, e.cycle);
+                break;
+            case CHIP8_EVENT_BEEP:
+                fprintf(sink, "BEEP!\n");
+                break;
+        }
+        ++totals.written;
+    }
+
+    // Caller holds lock, which is what makes this the only consumer of every ring
+    void drain(attachedRing & attached)
+    {
+        chip8Event e;
+        while (attached.ring->pop(e))
+            write(e);
+
+        unsigned long long dropped = attached.ring->dropped();
+        if (dropped != attached.reportedDrops)
+        {
+            fprintf(sink, "chip8: %llu events dropped, log buffer full\n", dropped - attached.reportedDrops);
+            attached.reportedDrops = dropped;
+        }
+    }
+
+    void drainAll()
+    {
+        for (size_t i = 0; i < rings.size(); ++i)
+            drain(rings[i]);
+    }
+};
+
+loggerState & state() {
+    static loggerState logger;
+    return logger;
+}
+
+}
+
+void chip8Logger::attach(chip8EventRing * ring) {
+    loggerState & logger = state();
+    std::lock_guard<std::mutex> guard(logger.lock);
+    attachedRing attached = { ring, ring->dropped() };
+    logger.rings.push_back(attached);
+}
+
+void chip8Logger::detach(chip8EventRing * ring) {
+    loggerState & logger = state();
+    std::lock_guard<std::mutex> guard(logger.lock);
+    for (size_t i = 0; i < logger.rings.size(); ++i)
+    {
+        if (logger.rings[i].ring != ring)
+            continue;
+
+        logger.drain(logger.rings[i]);
+        logger.detachedDrops += ring->dropped();
+        logger.rings.erase(logger.rings.begin() + i);
+        break;
+    }
+    fflush(logger.sink);
+}
+
+void chip8Logger::flush() {
+    loggerState & logger = state();
+    std::lock_guard<std::mutex> guard(logger.lock);
+    logger.drainAll();
+    fflush(logger.sink);
+}
+
+void chip8Logger::setSink(FILE * sink) {
+    loggerState & logger = state();
+    std::lock_guard<std::mutex> guard(logger.lock);
+    logger.drainAll();
+    fflush(logger.sink);
+    logger.sink = sink;
+}
+
+void chip8Logger::setRateLimit(unsigned int linesPerSecond) {
+    loggerState & logger = state();
+    std::lock_guard<std::mutex> guard(logger.lock);
+    logger.rateLimit = linesPerSecond;
+}
+
+chip8Logger::counters chip8Logger::getCounters() {
+    loggerState & logger = state();
+    std::lock_guard<std::mutex> guard(logger.lock);
+
+    counters c = logger.totals;
+    c.dropped = logger.detachedDrops;
+    for (size_t i = 0; i < logger.rings.size(); ++i)
+        c.dropped += logger.rings[i].ring->dropped();
+    return c;
+}
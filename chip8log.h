@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdio.h>
+#include <atomic>
+
+// Events the core reports while running. Emulation never writes to stdio itself: each machine pushes
+// its events into its own ring and a background thread turns them into text on the sink
+enum chip8EventType : unsigned char
+{
+    CHIP8_EVENT_UNKNOWN_OPCODE,     // Stalled on an opcode there's no handler for
+    CHIP8_EVENT_BEEP                // Sound timer ran out
+};
+
+struct chip8Event
+{
+    unsigned long long cycle;
+    unsigned short pc;
+    unsigned short opcode;
+    unsigned char type;
+};
+
+// Events a machine can have waiting before new ones are dropped (and counted). A power of two
+#define CHIP8_EVENT_RING_SIZE 1024
+
+// Single producer, single consumer ring with no locks. The machine that owns it pushes, the logger's
+// thread pops. Attaches itself to chip8Logger for its whole lifetime, whatever's left in it when it's
+// destroyed is written out first
+class chip8EventRing
+{
+    private:
+        chip8Event events[CHIP8_EVENT_RING_SIZE];
+        std::atomic<unsigned long> head;        // Next slot to write, only the producer moves it
+        std::atomic<unsigned long> tail;        // Next slot to read, only the consumer moves it
+        std::atomic<unsigned long long> droppedCount;
+
+    public:
+        chip8EventRing();
+        ~chip8EventRing();
+
+        chip8EventRing(const chip8EventRing &) = delete;
+        chip8EventRing & operator=(const chip8EventRing &) = delete;
+
+        // False (and counted as dropped) when the ring is full
+        bool push(unsigned char type, unsigned short pc, unsigned short opcode, unsigned long long cycle)
+        {
+            unsigned long h = head.load(std::memory_order_relaxed);
+            if (h - tail.load(std::memory_order_acquire) == CHIP8_EVENT_RING_SIZE)
+            {
+                droppedCount.store(droppedCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                return false;
+            }
+
+            chip8Event & e = events[h & (CHIP8_EVENT_RING_SIZE - 1)];
+            e.cycle = cycle;
+            e.pc = pc;
+            e.opcode = opcode;
+            e.type = type;
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Consumer side, only ever called by chip8Logger with its lock held
+        bool pop(chip8Event & e);
+
+        unsigned long long dropped() const { return droppedCount.load(std::memory_order_relaxed); }
+};
+
+// Drains every attached ring to one sink (stdout unless told otherwise) from a background thread,
+// roughly every 10ms. Past the rate limit events are counted rather than written, and both those and
+// events dropped on a full ring are reported as a summary line
+class chip8Logger
+{
+    public:
+        struct counters
+        {
+            unsigned long long written;
+            unsigned long long suppressed;  // Over the rate limit
+            unsigned long long dropped;     // Ring was full
+        };
+
+        static void attach(chip8EventRing * ring);
+        static void detach(chip8EventRing * ring);
+
+        // Writes out everything waiting right now, for callers about to print something that should come after
+        static void flush();
+
+        static void setSink(FILE * sink);
+
+        // Lines written per second before the rest are suppressed, 0 for no limit (default 1000)
+        static void setRateLimit(unsigned int linesPerSecond);
+
+        static counters getCounters();
+};
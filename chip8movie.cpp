@@ -0,0 +1,238 @@
+#include "chip8movie.h"
+#include <string.h>
+
+#define MOVIE_VERSION 3
+
+// Version 2 movies have no quirks line, which is the same as no quirks
+#define MOVIE_OLDEST_VERSION 2
+
+chip8Movie::chip8Movie() :
+    seed(CHIP8_DEFAULT_SEED), clockSpeed(CHIP8_DEFAULT_CLOCK), quirks(0), length(0), lastHash(0), startHash(0)
+{
+    memset(keys, 0, sizeof(keys));
+}
+
+unsigned long long chip8Movie::frameOf(unsigned long long cycle) const {
+    return cycle * 60 / clockSpeed;
+}
+
+unsigned long long chip8Movie::frameStart(unsigned long long frame) const {
+    return (frame * clockSpeed + 59) / 60;
+}
+
+bool chip8Movie::isFrameStart(unsigned long long cycle) const {
+    return cycle > 0 && frameStart(frameOf(cycle)) == cycle;
+}
+
+void chip8Movie::begin(chip8 & machine, const char * rom, unsigned long long movieSeed) {
+    romPath = rom;
+    seed = movieSeed;
+    clockSpeed = machine.getClockSpeed();
+    quirks = machine.getQuirks();
+    length = machine.getCycleCount();
+    events.clear();
+
+    machine.seedRandom(seed);
+    lastHash = startHash = machine.frameHash();
+
+    // Anything already held when recording starts goes in as a press on the first cycle
+    memset(keys, 0, sizeof(keys));
+    recordKeys(machine);
+}
+
+void chip8Movie::recordKeys(const chip8 & machine) {
+    unsigned long long cycle = machine.getCycleCount();
+    for (int i = 0; i < 16; ++i)
+    {
+        unsigned char pressed = machine.currentKey[i] != 0;
+        if (pressed == keys[i])
+            continue;
+
+        event e = { cycle, EVENT_KEY, (unsigned char)i, pressed, 0 };
+        events.push_back(e);
+        keys[i] = pressed;
+    }
+}
+
+void chip8Movie::emulate(chip8 & machine, unsigned long cycles) {
+    unsigned long long cycle = machine.getCycleCount();
+    unsigned long long target = cycle + cycles;
+
+    // Stop at every frame start on the way to note the hash
+    while (cycle < target)
+    {
+        unsigned long long next = frameStart(frameOf(cycle) + 1);
+        if (next > target)
+            next = target;
+
+        machine.emulateCycles(next - cycle);
+        cycle = next;
+
+        if (isFrameStart(cycle))
+        {
+            unsigned long long hash = machine.frameHash();
+            if (hash != lastHash)
+            {
+                event e = { cycle, EVENT_HASH, 0, 0, hash };
+                events.push_back(e);
+                lastHash = hash;
+            }
+        }
+    }
+}
+
+void chip8Movie::rewindTo(const chip8 & machine) {
+    unsigned long long cycle = machine.getCycleCount();
+    while (!events.empty() && events.back().cycle > cycle)
+        events.pop_back();
+
+    // Key state and the last hash as of what's left
+    memset(keys, 0, sizeof(keys));
+    lastHash = startHash;
+    for (size_t i = 0; i < events.size(); ++i)
+    {
+        if (events[i].type == EVENT_KEY)
+            keys[events[i].key] = events[i].pressed;
+        else
+            lastHash = events[i].hash;
+    }
+}
+
+void chip8Movie::end(const chip8 & machine) {
+    length = machine.getCycleCount();
+}
+
+unsigned long chip8Movie::replay(chip8 & machine, FILE * log) const {
+    machine.seedRandom(seed);
+    machine.setClockSpeed(clockSpeed);
+    machine.setQuirks(quirks);
+
+    unsigned long long cycle = machine.getCycleCount();
+    unsigned long long expected = machine.frameHash();
+    unsigned long mismatches = 0;
+    size_t i = 0;
+
+    for (;;)
+    {
+        if (isFrameStart(cycle))
+        {
+            while (i < events.size() && events[i].cycle == cycle && events[i].type == EVENT_HASH)
+                expected = events[i++].hash;
+
+            unsigned long long hash = machine.frameHash();
+            if (hash != expected)
+            {
+                ++mismatches;
+                if (log)
+                    fprintf(log, "Frame %llu (cycle %llu): hash %016llx, movie has %016llx\n", frameOf(cycle), cycle, hash, expected);
+            }
+        }
+
+        while (i < events.size() && events[i].cycle == cycle && events[i].type == EVENT_KEY)
+        {
+            machine.currentKey[events[i].key] = events[i].pressed;
+            ++i;
+        }
+
+        if (cycle >= length)
+            break;
+
+        // Run flat out to whichever comes first, the next event, the next frame start or the end
+        unsigned long long next = frameStart(frameOf(cycle) + 1);
+        if (i < events.size() && events[i].cycle < next)
+            next = events[i].cycle;
+        if (length < next)
+            next = length;
+
+        machine.emulateCycles(next - cycle);
+        cycle = next;
+    }
+
+    return mismatches;
+}
+
+bool chip8Movie::save(const char * filename) const {
+    FILE * pFile = fopen(filename, "w");
+    if (pFile == NULL)
+    {
+        fputs("File error", stderr);
+        return false;
+    }
+
+    fprintf(pFile, "chip8-movie %d\n", MOVIE_VERSION);
+    fprintf(pFile, "rom %s\n", romPath.c_str());
+    fprintf(pFile, "seed %llu\n", seed);
+    fprintf(pFile, "clock %u\n", clockSpeed);
+    fprintf(pFile, "quirks %u\n", quirks);
+    for (size_t i = 0; i < events.size(); ++i)
+    {
+        const event & e = events[i];
+        if (e.type == EVENT_KEY)
+            fprintf(pFile, "key %llu %llu %X %d\n", e.cycle, frameOf(e.cycle), e.key, e.pressed);
+        else
+            fprintf(pFile, "hash %llu %llu %016llx\n", e.cycle, frameOf(e.cycle), e.hash);
+    }
+    fprintf(pFile, "end %llu\n", length);
+
+    bool written = !ferror(pFile);
+    fclose(pFile);
+    return written;
+}
+
+bool chip8Movie::load(const char * filename) {
+    FILE * pFile = fopen(filename, "r");
+    if (pFile == NULL)
+    {
+        fputs("File error", stderr);
+        return false;
+    }
+
+    int version = 0;
+    char line[4096];
+    if (fgets(line, sizeof(line), pFile) == NULL || sscanf(line, "chip8-movie %d", &version) != 1 || version < MOVIE_OLDEST_VERSION || version > MOVIE_VERSION)
+    {
+        fputs("Not a chip8 movie, or from a different version\n", stderr);
+        fclose(pFile);
+        return false;
+    }
+
+    romPath.clear();
+    events.clear();
+    quirks = 0;
+    length = 0;
+
+    bool ended = false;
+    while (fgets(line, sizeof(line), pFile))
+    {
+        event e = { 0, EVENT_KEY, 0, 0, 0 };
+        unsigned long long frame;
+        unsigned int key, pressed;
+        char path[4096];
+
+        if (sscanf(line, "key %llu %llu %x %u", &e.cycle, &frame, &key, &pressed) == 4)
+        {
+            e.key = key & 0xF;
+            e.pressed = pressed != 0;
+            events.push_back(e);
+        }
+        else if (sscanf(line, "hash %llu %llu %llx", &e.cycle, &frame, &e.hash) == 3)
+        {
+            e.type = EVENT_HASH;
+            events.push_back(e);
+        }
+        else if (sscanf(line, "rom %4095[^\n]", path) == 1)
+            romPath = path;
+        else if (sscanf(line, "seed %llu", &seed) == 1 || sscanf(line, "clock %u", &clockSpeed) == 1 ||
+                 sscanf(line, "quirks %u", &quirks) == 1)
+            ;
+        else if (sscanf(line, "end %llu", &length) == 1)
+            ended = true;
+    }
+
+    fclose(pFile);
+    if (clockSpeed < 60)
+        clockSpeed = 60;
+    if (!ended)
+        fputs("Movie has no end line, it may be cut short\n", stderr);
+    return ended;
+}
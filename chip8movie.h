@@ -0,0 +1,72 @@
+#pragma once
+
+#include "chip8.h"
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// Input movies: every key change stamped with the emulated cycle (and frame) it happened on, the seed
+// CXNN's generator started from (chip8::seedRandom), the quirks the machine ran with, and the screen hash at every frame boundary where it changed.
+// Replaying one feeds the same keys in at the same cycles, so it's bit exact at any speed.
+//
+// Text file, one event per line:
+//     chip8-movie 3
+//     rom <path>
+//     seed <n>
+//     clock <instructions per second>
+//     quirks <CHIP8_QUIRK_* flags>
+//     key <cycle> <frame> <key 0-F> <1 pressed | 0 released>
+//     hash <cycle> <frame> <frameHash>
+//     end <cycle>
+//
+// Frame f starts at the first cycle c with c * 60 / clock >= f, hashes are taken right there,
+// before any key change on the same cycle is applied.
+class chip8Movie
+{
+    public:
+        enum eventType { EVENT_KEY, EVENT_HASH };
+
+        struct event
+        {
+            unsigned long long cycle;
+            unsigned char type;
+            unsigned char key;
+            unsigned char pressed;
+            unsigned long long hash;
+        };
+
+        std::string romPath;
+        unsigned long long seed;
+        unsigned int clockSpeed;
+        unsigned int quirks;
+        unsigned long long length;
+        std::vector<event> events;
+
+        chip8Movie();
+
+        bool save(const char * filename) const;
+        bool load(const char * filename);
+
+        // Recording. begin seeds the machine's random numbers, so call it straight after loading the ROM
+        void begin(chip8 & machine, const char * rom, unsigned long long seed);
+        void recordKeys(const chip8 & machine);
+        void emulate(chip8 & machine, unsigned long cycles);
+        void end(const chip8 & machine);
+
+        // The machine was rewound to an earlier state of this recording. Drops everything recorded after
+        // its cycle, so recording carries on from there as if the later part never happened
+        void rewindTo(const chip8 & machine);
+
+        // Plays the movie into a machine that has just loaded the ROM, as fast as it will go.
+        // Returns the number of frames whose hash didn't match, each one is logged to log if given
+        unsigned long replay(chip8 & machine, FILE * log) const;
+
+    private:
+        unsigned char keys[16];         // Key state as of the last recordKeys
+        unsigned long long lastHash;    // Last hash recorded, a new one is only written when it changes
+        unsigned long long startHash;   // Screen hash when recording began, what replay checks against before any hash event
+
+        unsigned long long frameOf(unsigned long long cycle) const;
+        unsigned long long frameStart(unsigned long long frame) const;
+        bool isFrameStart(unsigned long long cycle) const;
+};
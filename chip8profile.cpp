@@ -0,0 +1,215 @@
+#include "chip8profile.h"
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+
+// Deeper than this is runaway recursion, those calls stay counted in the deepest node
+#define PROFILE_MAX_DEPTH 256
+
+// How many opcodes and addresses the report lists
+#define PROFILE_TOP 32
+
+static const char * handlerNames[OP_COUNT] =
+{
+#define X(name) #name,
+    CHIP8_HANDLER_LIST(X)
+#undef X
+};
+
+chip8Profiler::chip8Profiler() :
+    opcodeCounts(65536)
+{
+    callNode top = { 0, -1, 0, 0, 0, std::vector<int>() };
+    nodes.push_back(top);
+    current = 0;
+    reset();
+}
+
+void chip8Profiler::reset() {
+    memset(handlerCounts, 0, sizeof(handlerCounts));
+    std::fill(opcodeCounts.begin(), opcodeCounts.end(), 0);
+    memset(pcCounts, 0, sizeof(pcCounts));
+    memset(pcOpcodes, 0, sizeof(pcOpcodes));
+
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        nodes[i].self = 0;
+        nodes[i].calls = 0;
+    }
+}
+
+void chip8Profiler::enter(unsigned short address) {
+    callNode & node = nodes[current];
+    if (node.depth >= PROFILE_MAX_DEPTH)
+        return;
+
+    for (size_t i = 0; i < node.children.size(); ++i)
+    {
+        if (nodes[node.children[i]].address == address)
+        {
+            current = node.children[i];
+            ++nodes[current].calls;
+            return;
+        }
+    }
+
+    callNode child = { address, current, node.depth + 1, 0, 1, std::vector<int>() };
+    nodes.push_back(child);
+    int index = (int)nodes.size() - 1;
+    nodes[current].children.push_back(index);
+    current = index;
+}
+
+void chip8Profiler::leave() {
+    if (current != 0)
+        current = nodes[current].parent;
+}
+
+void chip8Profiler::setCallStack(const unsigned short * stack, unsigned short stackPointer, const decodedInstruction * decoded, unsigned short addressMask) {
+    current = 0;
+    for (int i = 0; i < stackPointer && i < 16; ++i)
+    {
+        const decodedInstruction & call = decoded[(stack[i] - 2) & addressMask];
+        if (call.handler != OP_2NNN)
+            break;
+
+        // Already in progress, not a new call
+        enter(call.nnn);
+        --nodes[current].calls;
+    }
+}
+
+void chip8Profiler::countRepeated(unsigned short pc, const decodedInstruction & d, unsigned long long times) {
+    handlerCounts[d.handler] += times;
+    opcodeCounts[d.opcode] += times;
+    pcCounts[pc] += times;
+    pcOpcodes[pc] = d.opcode;
+    nodes[current].self += times;
+}
+
+unsigned long long chip8Profiler::instructions() const {
+    unsigned long long total = 0;
+    for (int i = 0; i < OP_COUNT; ++i)
+        total += handlerCounts[i];
+    return total;
+}
+
+// Fills totals with every node's inclusive count, its own instructions and all its callees'
+unsigned long long chip8Profiler::inclusive(int node, std::vector<unsigned long long> & totals) const {
+    unsigned long long total = nodes[node].self;
+    for (size_t i = 0; i < nodes[node].children.size(); ++i)
+        total += inclusive(nodes[node].children[i], totals);
+    totals[node] = total;
+    return total;
+}
+
+static double percent(unsigned long long count, unsigned long long total) {
+    return total > 0 ? 100.0 * count / total : 0.0;
+}
+
+// Indices of the nonzero counts, biggest first
+template <typename Count>
+static std::vector<int> hottest(const Count * counts, int size) {
+    std::vector<int> order;
+    for (int i = 0; i < size; ++i)
+        if (counts[i] != 0)
+            order.push_back(i);
+
+    std::stable_sort(order.begin(), order.end(), [counts](int a, int b) { return counts[a] > counts[b]; });
+    return order;
+}
+
+void chip8Profiler::writeReport(FILE * out) const {
+    unsigned long long total = instructions();
+    fprintf(out, "Instructions: %llu\n", total);
+
+    fprintf(out, "\nBy handler\n");
+    std::vector<int> handlers = hottest(handlerCounts, OP_COUNT);
+    for (size_t i = 0; i < handlers.size(); ++i)
+        fprintf(out, "  %-8s %14llu %6.2f%%\n", handlerNames[handlers[i]], handlerCounts[handlers[i]], percent(handlerCounts[handlers[i]], total));
+
+    fprintf(out, "\nBy opcode (top %d)\n", PROFILE_TOP);
+    std::vector<int> opcodes = hottest(&opcodeCounts[0], 65536);
+    for (size_t i = 0; i < opcodes.size() && i < PROFILE_TOP; ++i)
+    {
+        decodedInstruction d;
+        chip8::decode(opcodes[i], d);
+        fprintf(out, "  %04X %-8s %14llu %6.2f%%\n", opcodes[i], handlerNames[d.handler], opcodeCounts[opcodes[i]], percent(opcodeCounts[opcodes[i]], total));
+    }
+
+    fprintf(out, "\nBy address (top %d)\n", PROFILE_TOP);
+    std::vector<int> addresses = hottest(pcCounts, CHIP8_MEMORY_SIZE);
+    for (size_t i = 0; i < addresses.size() && i < PROFILE_TOP; ++i)
+        fprintf(out, "  %03X  %04X %14llu %6.2f%%\n", addresses[i], pcOpcodes[addresses[i]], pcCounts[addresses[i]], percent(pcCounts[addresses[i]], total));
+
+    // A subroutine's inclusive count only takes nodes with no copy of it further up the stack, so
+    // recursion isn't counted more than once
+    std::vector<unsigned long long> totals(nodes.size());
+    inclusive(0, totals);
+
+    std::vector<unsigned long long> self(CHIP8_MEMORY_SIZE), inside(CHIP8_MEMORY_SIZE), calls(CHIP8_MEMORY_SIZE);
+    for (size_t i = 1; i < nodes.size(); ++i)
+    {
+        unsigned short address = nodes[i].address;
+        self[address] += nodes[i].self;
+        calls[address] += nodes[i].calls;
+
+        bool recursive = false;
+        for (int p = nodes[i].parent; p > 0 && !recursive; p = nodes[p].parent)
+            recursive = nodes[p].address == nodes[i].address;
+        if (!recursive)
+            inside[address] += totals[i];
+    }
+
+    fprintf(out, "\nSubroutines          calls           self      inclusive\n");
+    fprintf(out, "  top level %14s %14llu %14llu %6.2f%%\n", "", nodes[0].self, totals[0], percent(totals[0], total));
+    std::vector<int> subroutines = hottest(&inside[0], CHIP8_MEMORY_SIZE);
+    for (size_t i = 0; i < subroutines.size(); ++i)
+    {
+        int a = subroutines[i];
+        fprintf(out, "  sub_%03X   %14llu %14llu %14llu %6.2f%%\n", a, calls[a], self[a], inside[a], percent(inside[a], total));
+    }
+
+    // One character per instruction slot, 32 to a line, on a log scale up to the hottest address
+    static const char shades[] = " .:-=+*#%@";
+    unsigned long long hottestCount = addresses.empty() ? 0 : pcCounts[addresses[0]];
+    int levels = (int)sizeof(shades) - 2;
+    double scale = hottestCount > 1 ? (levels - 1) / log((double)hottestCount) : 0;
+
+    fprintf(out, "\nHeatmap, one column per 2 bytes, '%s' from never to hottest\n", shades);
+    for (int row = 0; row < CHIP8_MEMORY_SIZE; row += 64)
+    {
+        bool used = false;
+        for (int a = row; a < row + 64; ++a)
+            used |= pcCounts[a] != 0;
+        if (!used)
+            continue;
+
+        char line[33];
+        for (int i = 0; i < 32; ++i)
+        {
+            unsigned long long count = pcCounts[row + i * 2] + pcCounts[row + i * 2 + 1];
+            line[i] = count == 0 ? shades[0] : shades[std::min(levels, 1 + (int)(log((double)count) * scale))];
+        }
+        line[32] = 0;
+        fprintf(out, "  %03X |%s|\n", row, line);
+    }
+}
+
+void chip8Profiler::writeFolded(FILE * out) const {
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        if (nodes[i].self == 0)
+            continue;
+
+        std::string stack;
+        for (int n = (int)i; n > 0; n = nodes[n].parent)
+        {
+            char frame[16];
+            snprintf(frame, sizeof(frame), ";sub_%03X", nodes[n].address);
+            stack.insert(0, frame);
+        }
+        fprintf(out, "main%s %llu\n", stack.c_str(), nodes[i].self);
+    }
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "chip8.h"
+#include <stdio.h>
+#include <vector>
+
+// Execution profile behind chip8's interpreter (build with -DCHIP8_PROFILE=1 and chip8profile.cpp)
+// Every instruction executed is counted by handler, by exact opcode and by the address it ran from.
+// Calls are followed through 2NNN and 00EE on a shadow call stack, each distinct stack of subroutines
+// is a node in a tree with the instructions run directly inside it. Without CHIP8_PROFILE the hooks
+// compile away to nothing.
+//
+// While profiling, emulateCycles interprets everything rather than using the JIT, and instructions
+// covered by idle loop fast-forwarding or an FX0A halt are counted as though they had run one by one.
+class chip8Profiler
+{
+    private:
+        // Call tree node. Node 0 is the top level, outside any subroutine
+        struct callNode
+        {
+            unsigned short address;     // Subroutine entry point
+            int parent;
+            int depth;
+            unsigned long long self;    // Instructions run in this subroutine with this exact stack
+            unsigned long long calls;
+            std::vector<int> children;
+        };
+
+        unsigned long long handlerCounts[OP_COUNT];
+        std::vector<unsigned long long> opcodeCounts;   // 65536, indexed by opcode
+        unsigned long long pcCounts[CHIP8_MEMORY_SIZE];
+        unsigned short pcOpcodes[CHIP8_MEMORY_SIZE];    // Last opcode seen at each address
+
+        std::vector<callNode> nodes;
+        int current;
+
+        void enter(unsigned short address);
+        void leave();
+        unsigned long long inclusive(int node, std::vector<unsigned long long> & totals) const;
+
+    public:
+        chip8Profiler();
+
+        // Clears every count. The call stack is left where it is
+        void reset();
+
+        // Rebuilds the shadow call stack from the machine's own, after a reset or a state load. Each
+        // return address follows the 2NNN that called the next subroutine in, within the addressMask the
+        // machine can reach
+        void setCallStack(const unsigned short * stack, unsigned short stackPointer, const decodedInstruction * decoded, unsigned short addressMask);
+
+        // One instruction about to run from pc
+        void count(unsigned short pc, const decodedInstruction & d)
+        {
+            ++handlerCounts[d.handler];
+            ++opcodeCounts[d.opcode];
+            ++pcCounts[pc];
+            pcOpcodes[pc] = d.opcode;
+            ++nodes[current].self;
+
+            if (d.handler == OP_2NNN)
+                enter(d.nnn);
+            else if (d.handler == OP_00EE)
+                leave();
+        }
+
+        // The same instruction run times times in a row, never a call or return
+        void countRepeated(unsigned short pc, const decodedInstruction & d, unsigned long long times);
+
+        unsigned long long instructions() const;
+        unsigned long long handlerCount(int handler) const { return handlerCounts[handler]; }
+        unsigned long long opcodeCount(unsigned short opcode) const { return opcodeCounts[opcode]; }
+        unsigned long long pcCount(unsigned short address) const { return pcCounts[address]; }
+
+        // Plain text, every table sorted hottest first: handlers, the top opcodes and addresses, subroutines
+        // with their own and inclusive instruction counts, and a heatmap of memory
+        void writeReport(FILE * out) const;
+
+        // One line per call stack, "main;sub_2A4;sub_310 1234", for flamegraph.pl and compatible tools
+        void writeFolded(FILE * out) const;
+};
@@ -0,0 +1,158 @@
+#include "chip8rewind.h"
+#include <string.h>
+
+chip8Rewind::chip8Rewind(size_t budgetBytes) :
+    ring(budgetBytes), head(0), currentSize(0), haveCurrent(false),
+    // Worst case is every other byte changed, 5 bytes for each pair
+    scratch(sizeof(chip8State) * 5)
+{
+}
+
+void chip8Rewind::clear() {
+    entries.clear();
+    head = 0;
+    haveCurrent = false;
+}
+
+size_t chip8Rewind::bytesUsed() const {
+    size_t total = 0;
+    for (size_t i = 0; i < entries.size(); ++i)
+        total += entries[i].size;
+    return total;
+}
+
+static void putCount(unsigned char * & out, size_t count) {
+    out[0] = count & 0xFF;
+    out[1] = count >> 8;
+    out += 2;
+}
+
+// A delta is runs of (unchanged bytes, changed bytes) as two 16 bit counts, followed by the changed bytes
+// XORed between the two states. The state is bigger than 64 KB, so a longer run is split: unchanged bytes
+// into pieces with nothing changed after them, changed bytes into pieces with nothing unchanged before them
+#define REWIND_MAX_RUN 0xFFFF
+
+size_t chip8Rewind::encode(const chip8State & state) {
+    const unsigned char * newer = (const unsigned char *)&current;
+    const unsigned char * older = (const unsigned char *)&state;
+    unsigned char * out = &scratch[0];
+
+    size_t size = currentSize;
+    size_t i = 0;
+    while (i < size)
+    {
+        // Skip unchanged bytes a word at a time, that's nearly all of them
+        size_t start = i;
+        while (i + 8 <= size)
+        {
+            uint64_t a, b;
+            memcpy(&a, newer + i, 8);
+            memcpy(&b, older + i, 8);
+            if (a != b)
+                break;
+            i += 8;
+        }
+        while (i < size && newer[i] == older[i])
+            ++i;
+        if (i == size)
+            break;
+
+        size_t changed = i;
+        while (i < size && newer[i] != older[i])
+            ++i;
+
+        size_t unchanged = changed - start;
+        for (; unchanged > REWIND_MAX_RUN; unchanged -= REWIND_MAX_RUN)
+        {
+            putCount(out, REWIND_MAX_RUN);
+            putCount(out, 0);
+        }
+
+        while (changed < i)
+        {
+            size_t length = i - changed < REWIND_MAX_RUN ? i - changed : REWIND_MAX_RUN;
+            putCount(out, unchanged);
+            putCount(out, length);
+            for (size_t j = changed; j < changed + length; ++j)
+                *out++ = newer[j] ^ older[j];
+            changed += length;
+            unchanged = 0;
+        }
+    }
+
+    return out - &scratch[0];
+}
+
+void chip8Rewind::decode(const unsigned char * data, size_t size) {
+    unsigned char * state = (unsigned char *)&current;
+    const unsigned char * end = data + size;
+    size_t i = 0;
+
+    while (data < end)
+    {
+        i += data[0] | data[1] << 8;
+        size_t changed = data[2] | data[3] << 8;
+        data += 4;
+
+        for (size_t j = 0; j < changed; ++j)
+            state[i + j] ^= data[j];
+        i += changed;
+        data += changed;
+    }
+}
+
+void chip8Rewind::record(const chip8Snapshot & snapshot) {
+    if (!haveCurrent || snapshot.stateSize != currentSize)
+    {
+        clear();
+        memcpy(&current, &snapshot.state, snapshot.stateSize);
+        currentSize = snapshot.stateSize;
+        haveCurrent = true;
+        return;
+    }
+
+    // The entry takes current back to the state before this one
+    size_t size = encode(snapshot.state);
+    memcpy(&current, &snapshot.state, currentSize);
+
+    if (size > ring.size())
+    {
+        entries.clear();
+        head = 0;
+        return;
+    }
+
+    // Anything left past head is the oldest history. Drop it before wrapping so what's kept stays unbroken
+    if (head + size > ring.size())
+    {
+        while (!entries.empty() && entries.front().offset >= head)
+            entries.pop_front();
+        head = 0;
+    }
+
+    // The oldest entries are the ones sitting just past head, drop any the new one would overwrite
+    while (!entries.empty() && entries.front().offset < head + size && entries.front().offset + entries.front().size > head)
+        entries.pop_front();
+
+    memcpy(&ring[head], &scratch[0], size);
+    entry e = { head, size };
+    entries.push_back(e);
+    head += size;
+}
+
+bool chip8Rewind::stepBack(chip8Snapshot & snapshot) {
+    if (entries.empty())
+        return false;
+
+    entry e = entries.back();
+    entries.pop_back();
+    decode(&ring[e.offset], e.size);
+    head = e.offset;
+
+    snapshot.magic = CHIP8_SNAPSHOT_MAGIC;
+    snapshot.version = CHIP8_SNAPSHOT_VERSION;
+    snapshot.stateSize = currentSize;
+    snapshot.reserved = 0;
+    memcpy(&snapshot.state, &current, currentSize);
+    return true;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "chip8.h"
+#include <stddef.h>
+#include <deque>
+#include <vector>
+
+// Rewind history for the front end. Only the newest state is kept whole, every older one is stored
+// as the XOR against the state after it, run-length encoded. Programs rarely touch more than a few
+// bytes of memory and screen a frame, so an entry is usually tens of bytes rather than the ~6 KB
+// of a snapshot (~68 KB with XO-CHIP). Entries live in a fixed size ring and the oldest are dropped
+// to make room.
+class chip8Rewind
+{
+    private:
+        struct entry
+        {
+            size_t offset;
+            size_t size;
+        };
+
+        std::vector<unsigned char> ring;
+        std::deque<entry> entries;      // Oldest first
+        size_t head;                    // Where the next entry goes
+
+        chip8State current;             // Newest state, the one every delta steps back from
+        size_t currentSize;             // Bytes of it in use, the snapshots' stateSize
+        bool haveCurrent;
+
+        std::vector<unsigned char> scratch;
+
+        size_t encode(const chip8State & state);
+        void decode(const unsigned char * data, size_t size);
+
+    public:
+        chip8Rewind(size_t budgetBytes);
+
+        // Adds a state, normally once a frame. One of a different size (the quirks changed XO-CHIP's memory)
+        // starts the history again
+        void record(const chip8Snapshot & snapshot);
+
+        // Steps one recorded frame back and writes that state to snapshot. False once history runs out
+        bool stepBack(chip8Snapshot & snapshot);
+
+        void clear();
+
+        size_t frames() const { return entries.size(); }
+        size_t bytesUsed() const;
+};
@@ -0,0 +1,491 @@
+#include "chip8rom.h"
+#include "chip8.h"
+#include <algorithm>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ARCHIVE_MAGIC "C8PK"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_HEADER_SIZE 12
+#define ARCHIVE_ENTRY_SIZE 16
+
+#define DATABASE_MAGIC "C8DB"
+#define DATABASE_VERSION 1
+#define DATABASE_HEADER_SIZE 12
+#define DATABASE_ENTRY_SIZE 32
+
+chip8RomFile::chip8RomFile() :
+    mapped(NULL), mappedSize(0)
+{
+}
+
+chip8RomFile::~chip8RomFile() {
+    close();
+}
+
+bool chip8RomFile::open(const char * filename) {
+    close();
+
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    // mmap refuses a zero length, an empty file is just an empty ROM
+    if (info.st_size > 0)
+    {
+        void * view = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (view == MAP_FAILED)
+        {
+            ::close(fd);
+            return false;
+        }
+        mapped = (const unsigned char *)view;
+        mappedSize = info.st_size;
+    }
+
+    // The mapping stays valid without the descriptor
+    ::close(fd);
+    return true;
+}
+
+void chip8RomFile::close() {
+    if (mapped)
+        munmap((void *)mapped, mappedSize);
+    mapped = NULL;
+    mappedSize = 0;
+}
+
+static uint32_t readLittle32(const unsigned char * p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t readLittle64(const unsigned char * p) {
+    return readLittle32(p) | (uint64_t)readLittle32(p + 4) << 32;
+}
+
+static void writeLittle32(FILE * out, uint32_t value) {
+    unsigned char bytes[4] = { (unsigned char)value, (unsigned char)(value >> 8), (unsigned char)(value >> 16), (unsigned char)(value >> 24) };
+    fwrite(bytes, 1, 4, out);
+}
+
+static void writeLittle64(FILE * out, uint64_t value) {
+    writeLittle32(out, (uint32_t)value);
+    writeLittle32(out, (uint32_t)(value >> 32));
+}
+
+chip8RomArchive::chip8RomArchive() :
+    entryCount(0)
+{
+}
+
+uint32_t chip8RomArchive::field(int entry, int index) const {
+    return readLittle32(file.data() + ARCHIVE_HEADER_SIZE + entry * ARCHIVE_ENTRY_SIZE + index * 4);
+}
+
+bool chip8RomArchive::open(const char * filename) {
+    entryCount = 0;
+    byName.clear();
+
+    if (!file.open(filename))
+    {
+        fprintf(stderr, "Can't open archive %s\n", filename);
+        return false;
+    }
+
+    const unsigned char * base = file.data();
+    size_t size = file.size();
+    if (size < ARCHIVE_HEADER_SIZE || memcmp(base, ARCHIVE_MAGIC, 4) != 0 || readLittle32(base + 4) != ARCHIVE_VERSION)
+    {
+        fprintf(stderr, "%s is not a ROM archive, or from a different version\n", filename);
+        file.close();
+        return false;
+    }
+
+    uint32_t count = readLittle32(base + 8);
+    if (count > (size - ARCHIVE_HEADER_SIZE) / ARCHIVE_ENTRY_SIZE)
+    {
+        fprintf(stderr, "%s is cut short\n", filename);
+        file.close();
+        return false;
+    }
+
+    entryCount = count;
+    for (int i = 0; i < (int)count; ++i)
+    {
+        uint64_t nameEnd = (uint64_t)field(i, 0) + field(i, 1);
+        uint64_t dataEnd = (uint64_t)field(i, 2) + field(i, 3);
+        if (nameEnd > size || dataEnd > size)
+        {
+            fprintf(stderr, "%s is cut short\n", filename);
+            entryCount = 0;
+            byName.clear();
+            file.close();
+            return false;
+        }
+        byName[name(i)] = i;
+    }
+    return true;
+}
+
+bool chip8RomArchive::write(const char * filename, const std::vector<std::string> & paths) {
+    // Names first, straight after the index, then the ROMs themselves
+    uint32_t offset = ARCHIVE_HEADER_SIZE + paths.size() * ARCHIVE_ENTRY_SIZE;
+    std::vector<uint32_t> nameOffsets, dataOffsets, dataSizes;
+    for (size_t i = 0; i < paths.size(); ++i)
+    {
+        nameOffsets.push_back(offset);
+        offset += paths[i].size();
+    }
+
+    // Sizes only for now, each ROM is mapped while it's copied in so a huge list never has them all mapped at once
+    for (size_t i = 0; i < paths.size(); ++i)
+    {
+        struct stat info;
+        if (stat(paths[i].c_str(), &info) != 0)
+        {
+            fprintf(stderr, "Can't open %s\n", paths[i].c_str());
+            return false;
+        }
+        dataOffsets.push_back(offset);
+        dataSizes.push_back(info.st_size);
+        offset += info.st_size;
+    }
+
+    FILE * out = fopen(filename, "wb");
+    if (out == NULL)
+    {
+        fprintf(stderr, "Can't create %s\n", filename);
+        return false;
+    }
+
+    fwrite(ARCHIVE_MAGIC, 1, 4, out);
+    writeLittle32(out, ARCHIVE_VERSION);
+    writeLittle32(out, paths.size());
+    for (size_t i = 0; i < paths.size(); ++i)
+    {
+        writeLittle32(out, nameOffsets[i]);
+        writeLittle32(out, paths[i].size());
+        writeLittle32(out, dataOffsets[i]);
+        writeLittle32(out, dataSizes[i]);
+    }
+    for (size_t i = 0; i < paths.size(); ++i)
+        fwrite(paths[i].data(), 1, paths[i].size(), out);
+
+    bool written = true;
+    for (size_t i = 0; i < paths.size() && written; ++i)
+    {
+        chip8RomFile rom;
+        written = rom.open(paths[i].c_str()) && rom.size() == dataSizes[i];
+        if (written)
+            fwrite(rom.data(), 1, rom.size(), out);
+        else
+            fprintf(stderr, "%s changed while packing\n", paths[i].c_str());
+    }
+
+    written = written && !ferror(out);
+    if (fclose(out) != 0)
+        written = false;
+    return written;
+}
+
+std::string chip8RomArchive::name(int entry) const {
+    return std::string((const char *)file.data() + field(entry, 0), field(entry, 1));
+}
+
+const unsigned char * chip8RomArchive::data(int entry) const {
+    return file.data() + field(entry, 2);
+}
+
+size_t chip8RomArchive::size(int entry) const {
+    return field(entry, 3);
+}
+
+int chip8RomArchive::find(const std::string & name) const {
+    std::map<std::string, int>::const_iterator it = byName.find(name);
+    return it == byName.end() ? -1 : it->second;
+}
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotateLeft(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static uint64_t hashRound(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    return rotateLeft(acc, 31) * PRIME64_1;
+}
+
+static uint64_t hashMerge(uint64_t acc, uint64_t lane) {
+    acc ^= hashRound(0, lane);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t chip8RomHash(const unsigned char * data, size_t size) {
+    const unsigned char * p = data;
+    const unsigned char * end = data + size;
+    uint64_t h;
+
+    // Four lanes over 32 byte stripes, then whatever's left folded in 8, 4 and 1 bytes at a time
+    if (size >= 32)
+    {
+        uint64_t v1 = PRIME64_1 + PRIME64_2, v2 = PRIME64_2, v3 = 0, v4 = 0 - PRIME64_1;
+        for (; end - p >= 32; p += 32)
+        {
+            v1 = hashRound(v1, readLittle64(p));
+            v2 = hashRound(v2, readLittle64(p + 8));
+            v3 = hashRound(v3, readLittle64(p + 16));
+            v4 = hashRound(v4, readLittle64(p + 24));
+        }
+        h = rotateLeft(v1, 1) + rotateLeft(v2, 7) + rotateLeft(v3, 12) + rotateLeft(v4, 18);
+        h = hashMerge(h, v1);
+        h = hashMerge(h, v2);
+        h = hashMerge(h, v3);
+        h = hashMerge(h, v4);
+    }
+    else
+        h = PRIME64_5;
+
+    h += size;
+    for (; end - p >= 8; p += 8)
+        h = rotateLeft(h ^ hashRound(0, readLittle64(p)), 27) * PRIME64_1 + PRIME64_4;
+    if (end - p >= 4)
+    {
+        h = rotateLeft(h ^ readLittle32(p) * PRIME64_1, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; ++p)
+        h = rotateLeft(h ^ *p * PRIME64_5, 11) * PRIME64_1;
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+chip8RomDatabase::chip8RomDatabase() :
+    entryCount(0)
+{
+}
+
+bool chip8RomDatabase::open(const char * filename) {
+    entryCount = 0;
+
+    if (!file.open(filename))
+    {
+        fprintf(stderr, "Can't open ROM database %s\n", filename);
+        return false;
+    }
+
+    const unsigned char * base = file.data();
+    size_t size = file.size();
+    if (size < DATABASE_HEADER_SIZE || memcmp(base, DATABASE_MAGIC, 4) != 0 || readLittle32(base + 4) != DATABASE_VERSION)
+    {
+        fprintf(stderr, "%s is not a ROM database, or from a different version\n", filename);
+        file.close();
+        return false;
+    }
+
+    uint32_t count = readLittle32(base + 8);
+    if (count > (size - DATABASE_HEADER_SIZE) / DATABASE_ENTRY_SIZE)
+    {
+        fprintf(stderr, "%s is cut short\n", filename);
+        file.close();
+        return false;
+    }
+
+    entryCount = count;
+    return true;
+}
+
+bool chip8RomDatabase::find(uint64_t hash, chip8RomProfile & profile) const {
+    if (entryCount == 0)
+        return false;
+
+    const unsigned char * entries = file.data() + DATABASE_HEADER_SIZE;
+
+    // Entries are sorted by hash, straight binary search over the mapped file
+    uint32_t low = 0, high = entryCount;
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        const unsigned char * entry = entries + (size_t)middle * DATABASE_ENTRY_SIZE;
+        uint64_t entryHash = readLittle64(entry);
+        if (entryHash < hash)
+            low = middle + 1;
+        else if (entryHash > hash)
+            high = middle;
+        else
+        {
+            profile.hash = entryHash;
+            profile.instructionsPerFrame = readLittle32(entry + 8);
+            profile.quirks = readLittle32(entry + 12) & CHIP8_QUIRK_ALL;
+            for (int i = 0; i < 16; ++i)
+                profile.keyMap[i] = entry[16 + i] & 0xF;
+            return true;
+        }
+    }
+    return false;
+}
+
+static const struct
+{
+    const char * name;
+    unsigned int flags;
+} quirkNames[] =
+{
+    { "none", 0 },
+    { "vf-reset", CHIP8_QUIRK_VF_RESET },
+    { "shift-vy", CHIP8_QUIRK_SHIFT_VY },
+    { "keep-i", CHIP8_QUIRK_KEEP_I },
+    { "jump-vx", CHIP8_QUIRK_JUMP_VX },
+    { "clip", CHIP8_QUIRK_CLIP },
+    { "xo-chip", CHIP8_QUIRK_XO_CHIP },
+    { "vip", CHIP8_VARIANT_COSMAC_VIP },
+    { "chip48", CHIP8_VARIANT_CHIP48 },
+    { "schip", CHIP8_VARIANT_SUPERCHIP },
+    { "modern", CHIP8_VARIANT_MODERN },
+    { "xochip", CHIP8_VARIANT_XO_CHIP },
+};
+
+bool chip8ParseQuirks(const char * text, unsigned int & quirks) {
+    quirks = 0;
+    while (*text)
+    {
+        size_t length = strcspn(text, ",");
+        bool known = false;
+        for (size_t i = 0; i < sizeof(quirkNames) / sizeof(quirkNames[0]) && !known; ++i)
+        {
+            if (strlen(quirkNames[i].name) == length && strncmp(text, quirkNames[i].name, length) == 0)
+            {
+                quirks |= quirkNames[i].flags;
+                known = true;
+            }
+        }
+        if (!known)
+            return false;
+
+        text += length;
+        if (*text == ',')
+            ++text;
+    }
+    return true;
+}
+
+// Exactly 16 hex digits, anything else is taken to be a path
+static bool parseHex16(const char * text, uint64_t & value) {
+    if (strlen(text) != 16 || strspn(text, "0123456789abcdefABCDEF") != 16)
+        return false;
+    value = strtoull(text, NULL, 16);
+    return true;
+}
+
+static bool profileOrder(const chip8RomProfile & a, const chip8RomProfile & b) {
+    return a.hash < b.hash;
+}
+
+bool chip8RomDatabase::compile(const char * sourcePath, const char * filename) {
+    FILE * source = fopen(sourcePath, "r");
+    if (source == NULL)
+    {
+        fprintf(stderr, "Can't open %s\n", sourcePath);
+        return false;
+    }
+
+    std::vector<chip8RomProfile> profiles;
+    char line[4096];
+    int lineNumber = 0;
+    bool parsed = true;
+    while (parsed && fgets(line, sizeof(line), source))
+    {
+        ++lineNumber;
+        char * comment = strchr(line, '#');
+        if (comment)
+            *comment = 0;
+
+        char rom[2048], quirks[256], keys[32];
+        chip8RomProfile profile;
+        int fields = sscanf(line, "%2047s %u %255s %31s", rom, &profile.instructionsPerFrame, quirks, keys);
+        if (fields <= 0)
+            continue;
+
+        for (int i = 0; i < 16; ++i)
+            profile.keyMap[i] = i;
+
+        parsed = fields >= 3 && chip8ParseQuirks(quirks, profile.quirks);
+        if (parsed && fields == 4)
+        {
+            uint64_t map;
+            parsed = parseHex16(keys, map);
+            for (int i = 0; i < 16 && parsed; ++i)
+                profile.keyMap[i] = (map >> (60 - i * 4)) & 0xF;
+        }
+
+        if (parsed && !parseHex16(rom, profile.hash))
+        {
+            chip8RomFile image;
+            parsed = image.open(rom);
+            if (parsed)
+                profile.hash = chip8RomHash(image.data(), image.size());
+        }
+
+        if (parsed)
+            profiles.push_back(profile);
+        else
+            fprintf(stderr, "%s:%d: can't make sense of this line\n", sourcePath, lineNumber);
+    }
+    fclose(source);
+    if (!parsed)
+        return false;
+
+    std::sort(profiles.begin(), profiles.end(), profileOrder);
+    for (size_t i = 1; i < profiles.size(); ++i)
+    {
+        if (profiles[i].hash == profiles[i - 1].hash)
+        {
+            fprintf(stderr, "%s: %016llx is listed twice\n", sourcePath, (unsigned long long)profiles[i].hash);
+            return false;
+        }
+    }
+
+    FILE * out = fopen(filename, "wb");
+    if (out == NULL)
+    {
+        fprintf(stderr, "Can't create %s\n", filename);
+        return false;
+    }
+
+    fwrite(DATABASE_MAGIC, 1, 4, out);
+    writeLittle32(out, DATABASE_VERSION);
+    writeLittle32(out, profiles.size());
+    for (size_t i = 0; i < profiles.size(); ++i)
+    {
+        writeLittle64(out, profiles[i].hash);
+        writeLittle32(out, profiles[i].instructionsPerFrame);
+        writeLittle32(out, profiles[i].quirks);
+        fwrite(profiles[i].keyMap, 1, 16, out);
+    }
+
+    bool written = !ferror(out);
+    if (fclose(out) != 0)
+        written = false;
+    return written;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+// Read-only view of a whole file through mmap, unmapped again when it goes out of scope. Hand data()
+// and size() to chip8::loadProgram and the ROM is copied exactly once, straight into the machine
+class chip8RomFile
+{
+    private:
+        const unsigned char * mapped;
+        size_t mappedSize;
+
+    public:
+        chip8RomFile();
+        ~chip8RomFile();
+
+        chip8RomFile(const chip8RomFile &) = delete;
+        chip8RomFile & operator=(const chip8RomFile &) = delete;
+
+        // False if the file can't be opened or mapped. An empty file opens fine with size 0
+        bool open(const char * filename);
+        void close();
+
+        const unsigned char * data() const { return mapped; }
+        size_t size() const { return mappedSize; }
+};
+
+// Many ROMs packed into one file, mapped once, so a batch over thousands of them costs one open
+// and no allocation per ROM. Layout, all integers little endian:
+//     header   "C8PK", uint32 version, uint32 count
+//     index    count entries of uint32 name offset, uint32 name length, uint32 data offset, uint32 data size
+//     names and ROM data, offsets are from the start of the file
+class chip8RomArchive
+{
+    private:
+        chip8RomFile file;
+        uint32_t entryCount;
+        std::map<std::string, int> byName;
+
+        uint32_t field(int entry, int index) const;
+
+    public:
+        chip8RomArchive();
+
+        // Checks the header and that every entry lies inside the file
+        bool open(const char * filename);
+
+        // Packs files into a new archive, each one named by its path as given
+        static bool write(const char * filename, const std::vector<std::string> & paths);
+
+        int count() const { return (int)entryCount; }
+        std::string name(int entry) const;
+        const unsigned char * data(int entry) const;
+        size_t size(int entry) const;
+
+        // Index of the ROM with that name, or -1
+        int find(const std::string & name) const;
+};
+
+// 64 bit xxHash (XXH64, seed 0) of a ROM image. What chip8::loadProgram keys the loaded program by
+uint64_t chip8RomHash(const unsigned char * data, size_t size);
+
+// Quirk flags from "none" or a comma separated list of vf-reset, shift-vy, keep-i, jump-vx, clip and xo-chip,
+// or the variants vip, chip48, schip, modern and xochip. False on any name it doesn't know
+bool chip8ParseQuirks(const char * text, unsigned int & quirks);
+
+// How to run one ROM: the speed it was written for, which CHIP-8 variant's quirks it expects and
+// which keys it should really see
+struct chip8RomProfile
+{
+    uint64_t hash;                      // chip8RomHash of the image
+    unsigned int instructionsPerFrame;  // Clock speed over 60, 0 to leave the clock alone
+    unsigned int quirks;                // CHIP8_QUIRK_* flags for chip8::setQuirks
+    unsigned char keyMap[16];           // Keypad key n presses CHIP-8 key keyMap[n]
+};
+
+// Profiles by ROM hash, compiled from a text list into an index that's mapped and searched in place,
+// so opening one is a single mmap however many ROMs it covers. Layout, all integers little endian:
+//     header   "C8DB", uint32 version, uint32 count
+//     entries  count of uint64 hash, uint32 instructions per frame, uint32 quirks, 16 key map bytes, by hash
+//
+// The text list has one ROM per line, # starts a comment:
+//     <hash or ROM path> <instructions per frame> <quirks> [key map]
+// where a hash is 16 hex digits as printed by chip8-headless, quirks are as chip8ParseQuirks takes them,
+// and the key map is 16 hex digits giving the CHIP-8 key each keypad key 0-F presses (0123456789ABCDEF,
+// the default, changes nothing)
+class chip8RomDatabase
+{
+    private:
+        chip8RomFile file;
+        uint32_t entryCount;
+
+    public:
+        chip8RomDatabase();
+
+        bool open(const char * filename);
+
+        // Parses a text list and writes the index for it, false (with the line at fault printed) on any error
+        static bool compile(const char * sourcePath, const char * filename);
+
+        int count() const { return (int)entryCount; }
+
+        // Fills in profile and returns true if the database knows the ROM
+        bool find(uint64_t hash, chip8RomProfile & profile) const;
+};
@@ -0,0 +1,186 @@
+// Headless driver, runs a ROM flat out with no window, X11 or OpenGL
+// Build: g++ -O2 -pthread chip8.cpp chip8log.cpp chip8rom.cpp chip8movie.cpp headless.cpp -o chip8-headless
+#include "chip8.h"
+#include "chip8movie.h"
+#include "chip8rom.h"
+#if CHIP8_PROFILE
+#include "chip8profile.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+chip8 programChip;
+
+static void usage(const char * program) {
+	fprintf(stderr, "Usage: %s [--clock HZ] [--seed N] [--quirks Q] [--romdb F] [--cycles N | --frames N] [rom]\n", program);
+	fprintf(stderr, "       %s --replay movie.txt [rom]\n", program);
+	fprintf(stderr, "  --clock HZ  Emulated instructions per second the 60Hz timers run against (default %d)\n", CHIP8_DEFAULT_CLOCK);
+	fprintf(stderr, "  --seed N    Seed for CXNN's random numbers (default %d)\n", CHIP8_DEFAULT_SEED);
+	fprintf(stderr, "  --quirks Q  Run as the variant vip, chip48, schip, modern or xochip, or with a comma separated list of\n");
+	fprintf(stderr, "              vf-reset, shift-vy, keep-i, jump-vx, clip and xo-chip (default none)\n");
+	fprintf(stderr, "  --romdb F   Take the ROM's speed and quirks from a ROM database if it's listed, --clock and --quirks still win\n");
+	fprintf(stderr, "  --cycles N  Run N instructions (default 600000)\n");
+	fprintf(stderr, "  --frames N  Run N 60Hz frames worth of instructions at the clock speed\n");
+	fprintf(stderr, "  --replay M  Play back an input movie flat out and check its frame hashes, the ROM defaults to the movie's\n");
+	fprintf(stderr, "  --profile F Write an execution profile report to F (CHIP8_PROFILE builds)\n");
+	fprintf(stderr, "  --folded F  Write the profile's call stacks to F in flamegraph folded format (CHIP8_PROFILE builds)\n");
+	fprintf(stderr, "  rom         ROM to load (default ./currGame.c8)\n");
+}
+
+static const char * profilePath = NULL;
+static const char * foldedPath = NULL;
+
+static bool writeProfile() {
+#if CHIP8_PROFILE
+	const char * paths[2] = { profilePath, foldedPath };
+	for (int i = 0; i < 2; ++i)
+	{
+		if (paths[i] == NULL)
+			continue;
+
+		FILE * out = fopen(paths[i], "w");
+		if (out == NULL)
+		{
+			fputs("File error", stderr);
+			return false;
+		}
+		if (i == 0)
+			programChip.getProfiler().writeReport(out);
+		else
+			programChip.getProfiler().writeFolded(out);
+		fclose(out);
+	}
+#endif
+	return true;
+}
+
+static int replay(const char * moviePath, const char * romPath) {
+	chip8Movie movie;
+	if (!movie.load(moviePath))
+		return 1;
+	if (romPath == NULL)
+		romPath = movie.romPath.c_str();
+
+	programChip.setClockSpeed(movie.clockSpeed);
+	if (!programChip.loadFile(romPath))
+		return 1;
+
+	auto start = std::chrono::steady_clock::now();
+	unsigned long mismatches = movie.replay(programChip, stdout);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	double emulated = (double)movie.length / movie.clockSpeed;
+
+	chip8Logger::flush();
+	printf("Cycles: %llu\n", movie.length);
+	printf("Emulated time: %.3f s at %u Hz\n", emulated, movie.clockSpeed);
+	printf("Wall time: %.6f s\n", seconds);
+	if (seconds > 0)
+		printf("Speed: %.0f instructions/s (%.0fx real time)\n", movie.length / seconds, emulated / seconds);
+	printf("gfx hash: %016llx\n", programChip.frameHash());
+	printf("Replay %s, %lu mismatched frames\n", mismatches ? "FAILED" : "matched", mismatches);
+	if (!writeProfile())
+		return 1;
+	return mismatches ? 2 : 0;
+}
+
+int main(int argc, char** argv) {
+	const char * romPath = NULL;
+	const char * moviePath = NULL;
+	unsigned long cycles = 600000;
+	unsigned long frames = 0;
+	unsigned int clock = CHIP8_DEFAULT_CLOCK;
+	bool clockGiven = false;
+	unsigned int quirks = 0;
+	bool quirksGiven = false;
+	const char * romDatabasePath = NULL;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc)
+			cycles = strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+			frames = strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+			moviePath = argv[++i];
+		else if (strcmp(argv[i], "--clock") == 0 && i + 1 < argc)
+		{
+			clock = strtoul(argv[++i], NULL, 10);
+			clockGiven = true;
+		}
+		else if (strcmp(argv[i], "--romdb") == 0 && i + 1 < argc)
+			romDatabasePath = argv[++i];
+		else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc)
+		{
+			if (!chip8ParseQuirks(argv[++i], quirks))
+			{
+				fprintf(stderr, "Unknown quirks %s\n", argv[i]);
+				return 1;
+			}
+			quirksGiven = true;
+		}
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+			programChip.seedRandom(strtoull(argv[++i], NULL, 10));
+		else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+			profilePath = argv[++i];
+		else if (strcmp(argv[i], "--folded") == 0 && i + 1 < argc)
+			foldedPath = argv[++i];
+		else if (argv[i][0] == '-')
+		{
+			usage(argv[0]);
+			return 1;
+		}
+		else
+			romPath = argv[i];
+	}
+
+	if ((profilePath || foldedPath) && !CHIP8_PROFILE)
+	{
+		fputs("Built without profiling, rebuild with -DCHIP8_PROFILE=1 and chip8profile.cpp\n", stderr);
+		return 1;
+	}
+
+	if (moviePath)
+		return replay(moviePath, romPath);
+	if (romPath == NULL)
+		romPath = "./currGame.c8";
+
+	if (!programChip.loadFile(romPath))
+		return 1;
+
+	if (romDatabasePath)
+	{
+		chip8RomDatabase romDatabase;
+		chip8RomProfile profile;
+		if (!romDatabase.open(romDatabasePath))
+			return 1;
+		if (romDatabase.find(programChip.getRomHash(), profile))
+		{
+			if (profile.instructionsPerFrame > 0 && !clockGiven)
+				clock = profile.instructionsPerFrame * 60;
+			if (!quirksGiven)
+				quirks = profile.quirks;
+		}
+	}
+
+	programChip.setQuirks(quirks);
+	programChip.setClockSpeed(clock);
+	clock = programChip.getClockSpeed();
+	if (frames > 0)
+		cycles = (unsigned long)((unsigned long long)frames * clock / 60);
+
+	auto start = std::chrono::steady_clock::now();
+	programChip.emulateCycles(cycles);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	chip8Logger::flush();
+	printf("Cycles: %lu\n", cycles);
+	printf("Emulated time: %.3f s at %u Hz\n", (double)cycles / clock, clock);
+	printf("Wall time: %.6f s\n", seconds);
+	if (seconds > 0)
+		printf("Speed: %.0f instructions/s\n", cycles / seconds);
+	printf("gfx hash: %016llx\n", programChip.frameHash());
+	printf("ROM hash: %016llx, quirks %02x\n", (unsigned long long)programChip.getRomHash(), programChip.getQuirks());
+	return writeProfile() ? 0 : 1;
+}
@@ -1,98 +1,385 @@
 #include "chip8.h"
+#include "chip8rewind.h"
+#include "chip8movie.h"
+#include "chip8rom.h"
+#include "chip8frame.h"
 
 #define OLC_PGE_APPLICATION
 #include "olcPixelGameEngine.h"
 
+// 1 expands the display straight into a 128x64 sprite and draws it as one scaled decal,
+// 0 paints the draw target with a Draw call per pixel. Either way the low resolution screen is drawn at double size
+#ifndef CHIP8_DECAL_RENDER
+#define CHIP8_DECAL_RENDER 1
+#endif
+
 chip8 programChip;
 
 class ChipEngine : public olc::PixelGameEngine
 {
 public:
-	ChipStart()
+	ChipEngine()
 	{
 		sAppName = "Chip8";
 	}
 
+	~ChipEngine()
+	{
+		stopEmulation();
+	}
+
 public:
-	float fTargetFrameTime = 1.0f / 600.0f; // This is esentially time given per instruction
+	float fTargetFrameTime = 1.0f / CHIP8_DEFAULT_CLOCK; // This is esentially time given per instruction, set from the clock speed
 	float fAccumulatedTime = 0.0f;
+	bool bUnthrottled = false; // Run flat out, the timers still follow emulated time so games behave the same
+
+	// Rewind, a state is recorded every 60th of a second of emulated time and holding Backspace steps back through them
+	// one per 60th of a second of real time, unthrottled or not
+	size_t nRewindBudget = 8 * 1024 * 1024;
+	std::unique_ptr<chip8Rewind> rewind;
+	chip8Snapshot rewindState;
+
+	// Input movie being recorded, written out when the window closes. Rewinding while recording cuts the
+	// movie back to the state rewound to, the random numbers are part of that state so it replays the same
+	std::string sRomPath;
+	std::string sMoviePath;
+	std::unique_ptr<chip8Movie> movie;
+
+	float fIdleFrameTime = 1.0f / 60.0f; // Length of one emulated frame, and the longest the window sleeps when there's nothing new to show
+
+	// The machine runs on its own thread, a 60th of a second at a time, and never waits on the window. Each frame
+	// that changed the screen is published through the triple buffer, and the window draws the newest one it finds,
+	// so a slow present drops frames rather than slowing the emulation down. Keys and Backspace go the other way
+	// as atomics, picked up at the start of each emulated frame. Nothing else touches programChip while the thread runs
+	std::thread emulationThread;
+	std::atomic<bool> bStopping{ false };
+	std::atomic<unsigned int> nHeldKeys{ 0 }; // Bit n set while CHIP-8 key n is down
+	std::atomic<bool> bRewinding{ false };
+	chip8TripleBuffer<chip8Frame> frames;
+	uint64_t nUnseenRows = 0; // Rows changed by frames published since the window last took one, emulation thread only
+
+	// A colour for each combination of the two bitplanes: neither, plane 0, plane 1, both. Only XO-CHIP draws
+	// into plane 1, so anything else is black and white as always
+	const olc::Pixel palette[4] = {
+		olc::Pixel(0, 0, 0), olc::Pixel(255, 255, 255), olc::Pixel(255, 102, 0), olc::Pixel(102, 34, 0)
+	};
+
+#if CHIP8_DECAL_RENDER
+	std::unique_ptr<olc::Sprite> screenSprite;
+	std::unique_ptr<olc::Decal> screenDecal;
+#endif
 
 	bool OnUserCreate() override
 	{
 		// Called once at the start, so create things here
+		fTargetFrameTime = 1.0f / programChip.getClockSpeed();
+		rewind.reset(new chip8Rewind(nRewindBudget));
+#if CHIP8_DECAL_RENDER
+		buildExpandTable();
+		screenSprite.reset(new olc::Sprite(128, 64));
+		screenDecal.reset(new olc::Decal(screenSprite.get()));
+#endif
+		if (!sMoviePath.empty())
+		{
+			movie.reset(new chip8Movie());
+			movie->begin(programChip, sRomPath.c_str(), programChip.getRandomSeed());
+		}
+		emulationThread = std::thread(&ChipEngine::runEmulation, this);
+		return true;
+	}
+
+	bool OnUserDestroy() override
+	{
+		stopEmulation();
+		if (movie)
+		{
+			movie->end(programChip);
+			movie->save(sMoviePath.c_str());
+			movie.reset();
+		}
 		return true;
 	}
 
 	bool OnUserUpdate(float fElapsedTime) override
 	{
+		handleUserInput();
 
+		bool newFrame = frames.acquire();
+		const chip8Frame & frame = frames.front();
+		uint64_t dirtyRows = newFrame ? frame.dirtyRows : 0;
+#if CHIP8_DECAL_RENDER
+		// Expand the changed rows into the sprite, upload it only if something changed, and draw
+		// it over the whole screen every frame since decals don't persist between frames
+		if (dirtyRows)
+		{
+			expandRows((uint32_t *)screenSprite->GetData(), frame, dirtyRows);
+			screenDecal->Update();
+		}
+		DrawDecal({ 0.0f, 0.0f }, screenDecal.get());
+#else
+		// Only repaint the rows the core says changed, the rest of the draw target still holds the last frame
+		int scale = frame.hires ? 1 : 2;
+		for (int y = 0; y < 64 / scale; ++y)
+		{
+			if ((dirtyRows & (1ull << y)) == 0)
+				continue;
 
-		if (programChip.drawFlag) {
-			for(int y = 0; y < 32; ++y)
-				for (int x = 0; x < 64; ++x) {
-					if (programChip.gfx[(y * 64) + x] == 0)
-						Draw(x, y, olc::Pixel(0, 0, 0));	// Disabled
-					else
-						Draw(x, y, olc::Pixel(255, 255, 255)); // Enabled
-				}
+			for (int x = 0; x < 128 / scale; ++x) {
+				int shift = 63 - (x & 63);
+				int colour = ((frame.display[0][y][x >> 6] >> shift) & 1) | ((frame.display[1][y][x >> 6] >> shift) & 1) << 1;
+				FillRect(x * scale, y * scale, scale, scale, palette[colour]);
+			}
 		}
-		handleUserInput();
+#endif
+
+		// Nothing new from the emulation, so rather than spinning round presenting the same frame, sleep out the
+		// rest of a 60Hz frame. Only input waits on this, the emulation thread keeps its own time
+		if (!newFrame && fElapsedTime < fIdleFrameTime)
+			std::this_thread::sleep_for(std::chrono::duration<float>(fIdleFrameTime - fElapsedTime));
+		return true;
+	}
 
-		fAccumulatedTime += fElapsedTime;
-		if (fAccumulatedTime >= fTargetFrameTime)
+	void stopEmulation() {
+		if (!emulationThread.joinable())
+			return;
+		bStopping.store(true, std::memory_order_relaxed);
+		emulationThread.join();
+	}
+
+	// Emulation thread. Runs a 60th of a second of emulated time per pass, timed from the steady clock, and
+	// sleeps until the next one is due. Falling behind (a stalled thread, a slow frame) is caught up through
+	// the accumulator on the next pass rather than by running passes back to back. Rewinding steps back one
+	// recorded frame per pass, paced the same in every mode
+	void runEmulation() {
+		std::chrono::steady_clock::duration frameLength = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(fIdleFrameTime));
+		std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+		std::chrono::steady_clock::time_point next = last + frameLength;
+		while (!bStopping.load(std::memory_order_relaxed))
 		{
-			while (fAccumulatedTime > fTargetFrameTime)
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			bool bRewound = emulateFrame(std::chrono::duration<float>(now - last).count());
+			last = now;
+			publishFrame();
+
+			// Flat out there's no waiting, unless the program is only waiting on a key or a timer or we're rewinding.
+			// Halted in FX0A, a frame costs one key scan and a clock bump, so a menu waiting for input sits at next to
+			// no CPU
+			now = std::chrono::steady_clock::now();
+			if (next < now)
+				next = now;
+			if (!bUnthrottled || bRewound || programChip.isIdle())
+				std::this_thread::sleep_until(next);
+			next += frameLength;
+		}
+	}
+
+	// True when the pass was a rewind step rather than emulation
+	bool emulateFrame(float fElapsedTime) {
+		unsigned int keys = nHeldKeys.load(std::memory_order_relaxed);
+		if (bRewinding.load(std::memory_order_relaxed))
+		{
+			// Emulation waits while rewinding. Keys come back as they were recorded, so let go of them all;
+			// whatever is really held is pressed again once emulation carries on
+			if (rewind->stepBack(rewindState))
 			{
-				programChip.emulateCycle();
-				fAccumulatedTime -= fTargetFrameTime;
+				programChip.loadState(rewindState);
+				for (int i = 0; i < 16; ++i)
+					programChip.currentKey[i] = 0;
+				if (movie)
+					movie->rewindTo(programChip);
 			}
-			fElapsedTime = fTargetFrameTime;
+			fAccumulatedTime = 0.0f;
+			return true;
 		}
-		return true;
+
+		for (int i = 0; i < 16; ++i)
+			programChip.currentKey[i] = (keys >> i) & 1;
+		if (movie)
+			movie->recordKeys(programChip);
+
+		emulate(fElapsedTime);
+		return false;
 	}
 
-	void handleUserInput() {
-		if (GetKey(olc::Key::K1).bPressed) programChip.currentKey[0x1] = 1;
-		if (GetKey(olc::Key::K2).bPressed) programChip.currentKey[0x2] = 1;
-		if (GetKey(olc::Key::K3).bPressed) programChip.currentKey[0x3] = 1;
-		if (GetKey(olc::Key::K4).bPressed) programChip.currentKey[0xC] = 1;
-		if (GetKey(olc::Key::Q).bPressed) programChip.currentKey[0x4] = 1;
-		if (GetKey(olc::Key::W).bPressed) programChip.currentKey[0x5] = 1;
-		if (GetKey(olc::Key::E).bPressed) programChip.currentKey[0x6] = 1;
-		if (GetKey(olc::Key::R).bPressed) programChip.currentKey[0xD] = 1;
-		if (GetKey(olc::Key::A).bPressed) programChip.currentKey[0x7] = 1;
-		if (GetKey(olc::Key::S).bPressed) programChip.currentKey[0x8] = 1;
-		if (GetKey(olc::Key::D).bPressed) programChip.currentKey[0x9] = 1;
-		if (GetKey(olc::Key::F).bPressed) programChip.currentKey[0xE] = 1;
-		if (GetKey(olc::Key::Z).bPressed) programChip.currentKey[0xA] = 1;
-		if (GetKey(olc::Key::X).bPressed) programChip.currentKey[0x0] = 1;
-		if (GetKey(olc::Key::C).bPressed) programChip.currentKey[0xB] = 1;
-		if (GetKey(olc::Key::V).bPressed) programChip.currentKey[0xF] = 1;
-
-		if (GetKey(olc::Key::K1).bReleased) programChip.currentKey[0x1] = 0;
-		if (GetKey(olc::Key::K2).bReleased) programChip.currentKey[0x2] = 0;
-		if (GetKey(olc::Key::K3).bReleased) programChip.currentKey[0x3] = 0;
-		if (GetKey(olc::Key::K4).bReleased) programChip.currentKey[0xC] = 0;
-		if (GetKey(olc::Key::Q).bReleased) programChip.currentKey[0x4] = 0;
-		if (GetKey(olc::Key::W).bReleased) programChip.currentKey[0x5] = 0;
-		if (GetKey(olc::Key::E).bReleased) programChip.currentKey[0x6] = 0;
-		if (GetKey(olc::Key::R).bReleased) programChip.currentKey[0xD] = 0;
-		if (GetKey(olc::Key::A).bReleased) programChip.currentKey[0x7] = 0;
-		if (GetKey(olc::Key::S).bReleased) programChip.currentKey[0x8] = 0;
-		if (GetKey(olc::Key::D).bReleased) programChip.currentKey[0x9] = 0;
-		if (GetKey(olc::Key::F).bReleased) programChip.currentKey[0xE] = 0;
-		if (GetKey(olc::Key::Z).bReleased) programChip.currentKey[0xA] = 0;
-		if (GetKey(olc::Key::X).bReleased) programChip.currentKey[0x0] = 0;
-		if (GetKey(olc::Key::C).bReleased) programChip.currentKey[0xB] = 0;
-		if (GetKey(olc::Key::V).bReleased) programChip.currentKey[0xF] = 0;
+	void recordRewind() {
+		programChip.saveState(rewindState);
+		rewind->record(rewindState);
+	}
+
+	// Copies the screen out if this frame changed it. Frames the window never took are replaced, so the rows they
+	// changed stay marked until a frame carrying them is taken
+	void publishFrame() {
+		uint64_t rows = programChip.takeDirtyRows();
+		if (rows == 0)
+			return;
 
+		chip8Frame & frame = frames.back();
+		memcpy(frame.display, programChip.display, sizeof(frame.display));
+		frame.hires = programChip.isHires();
+		frame.dirtyRows = rows | nUnseenRows;
+		nUnseenRows = frames.publish() ? frame.dirtyRows : rows;
+	}
+
+	void emulate(float fElapsedTime) {
+		if (bUnthrottled)
+		{
+			// Keep running 60Hz frames worth of instructions until a 60th of a second of real time has gone,
+			// or the program settles into waiting for a key. Each of them is recorded, so rewinding goes back
+			// through emulated time at the same rate as when throttled
+			auto start = std::chrono::steady_clock::now();
+			do
+			{
+				runCycles(programChip.getClockSpeed() / 60);
+				recordRewind();
+			}
+			while (!programChip.isIdle() && std::chrono::steady_clock::now() - start < std::chrono::duration<float>(fIdleFrameTime));
+		}
+		else
+		{
+			fAccumulatedTime += fElapsedTime;
+			unsigned long cycles = (unsigned long)(fAccumulatedTime / fTargetFrameTime);
+			fAccumulatedTime -= cycles * fTargetFrameTime;
+			runCycles(cycles);
+			recordRewind();
+		}
+	}
+
+	void runCycles(unsigned long cycles) {
+		if (movie)
+			movie->emulate(programChip, cycles);
+		else
+			programChip.emulateCycles(cycles);
+	}
+
+#if CHIP8_DECAL_RENDER
+	// Four RGBA pixels for every pair of plane nibbles, plane 0's in the low half of the index and plane 1's in
+	// the high half. Combining the planes into palette colours is then one lookup per four pixels in the same pass
+	// that expands the row: 32 copies of 16 bytes for a high resolution row. The doubled table does the same for
+	// low resolution with every pixel two wide
+	uint32_t expandTable[256][4];
+	uint32_t expandDoubleTable[256][8];
+
+	void buildExpandTable() {
+		// Bit 3 of each nibble is the leftmost of its four pixels
+		for (int b = 0; b < 256; ++b)
+			for (int i = 0; i < 4; ++i)
+			{
+				uint32_t colour = palette[((b >> (3 - i)) & 1) | ((b >> (7 - i)) & 1) << 1].n;
+				expandTable[b][i] = colour;
+				expandDoubleTable[b][i * 2] = expandDoubleTable[b][i * 2 + 1] = colour;
+			}
+	}
+
+	static int nibblePair(uint64_t plane0, uint64_t plane1, int shift) {
+		return ((plane0 >> shift) & 0xF) | ((plane1 >> shift) & 0xF) << 4;
+	}
+
+	void expandRows(uint32_t * pixels, const chip8Frame & frame, uint64_t rows) {
+		for (int y = 0; y < (frame.hires ? 64 : 32); ++y)
+		{
+			if ((rows & (1ull << y)) == 0)
+				continue;
+
+			const uint64_t * plane0 = frame.display[0][y];
+			const uint64_t * plane1 = frame.display[1][y];
+			if (frame.hires)
+			{
+				uint32_t * out = pixels + y * 128;
+				for (int i = 0; i < 32; ++i)
+					memcpy(out + i * 4, expandTable[nibblePair(plane0[i >> 4], plane1[i >> 4], 60 - (i & 15) * 4)], sizeof(expandTable[0]));
+			}
+			else
+			{
+				// One row expanded, then copied to the row under it
+				uint32_t * out = pixels + y * 2 * 128;
+				for (int i = 0; i < 16; ++i)
+					memcpy(out + i * 8, expandDoubleTable[nibblePair(plane0[0], plane1[0], 60 - i * 4)], sizeof(expandDoubleTable[0]));
+				memcpy(out + 128, out, 128 * sizeof(uint32_t));
+			}
+		}
+	}
+#endif
+
+	// Host keys laid out like the keypad, in the order of the keypad keys 0-F they stand for
+	const olc::Key keypad[16] = {
+		olc::Key::X, olc::Key::K1, olc::Key::K2, olc::Key::K3,
+		olc::Key::Q, olc::Key::W, olc::Key::E, olc::Key::A,
+		olc::Key::S, olc::Key::D, olc::Key::Z, olc::Key::C,
+		olc::Key::K4, olc::Key::R, olc::Key::F, olc::Key::V
+	};
+
+	// CHIP-8 key each keypad key presses, from the ROM's database entry if it has one
+	unsigned char keyMap[16] = { 0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0x8, 0x9, 0xA, 0xB, 0xC, 0xD, 0xE, 0xF };
+
+	// Hands the emulation thread the keys held this frame, it presses them at the start of its next one
+	void handleUserInput() {
+		unsigned int keys = 0;
+		for (int i = 0; i < 16; ++i)
+			if (GetKey(keypad[i]).bHeld) keys |= 1u << keyMap[i];
+		nHeldKeys.store(keys, std::memory_order_relaxed);
+		bRewinding.store(GetKey(olc::Key::BACK).bHeld, std::memory_order_relaxed);
 	}
 };
 
 int main(int argc, char** argv) {
-	programChip.loadFile("./currGame.c8");
+	const char * romPath = "./currGame.c8";
+	const char * romDatabasePath = NULL;
+	unsigned long long seed = (unsigned long long)time(NULL);
+	bool clockGiven = false;
+	unsigned int quirks = 0;
+	bool quirksGiven = false;
 	ChipEngine demo;
-	if (demo.Construct(64, 32, 20, 20))
+
+	// chip8 [--clock HZ] [--unthrottled] [--rewind-mb N] [--record movie.txt] [--seed N] [--quirks Q] [--romdb roms.c8db] [rom]
+	// Without --seed every run gets different random numbers. A ROM in the database gets its speed, quirks and
+	// key map from there, --clock and --quirks (names as chip8ParseQuirks takes them) still win
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--clock") == 0 && i + 1 < argc)
+		{
+			programChip.setClockSpeed(strtoul(argv[++i], NULL, 10));
+			clockGiven = true;
+		}
+		else if (strcmp(argv[i], "--unthrottled") == 0)
+			demo.bUnthrottled = true;
+		else if (strcmp(argv[i], "--rewind-mb") == 0 && i + 1 < argc)
+			demo.nRewindBudget = strtoul(argv[++i], NULL, 10) * 1024 * 1024;
+		else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+			demo.sMoviePath = argv[++i];
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+			seed = strtoull(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--romdb") == 0 && i + 1 < argc)
+			romDatabasePath = argv[++i];
+		else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc)
+		{
+			if (!chip8ParseQuirks(argv[++i], quirks))
+			{
+				fprintf(stderr, "Unknown quirks %s\n", argv[i]);
+				return 1;
+			}
+			quirksGiven = true;
+		}
+		else
+			romPath = argv[i];
+	}
+
+	programChip.seedRandom(seed);
+	programChip.loadFile(romPath);
+	demo.sRomPath = romPath;
+
+	chip8RomDatabase romDatabase;
+	chip8RomProfile profile;
+	if (romDatabasePath && romDatabase.open(romDatabasePath) && romDatabase.find(programChip.getRomHash(), profile))
+	{
+		if (profile.instructionsPerFrame > 0 && !clockGiven)
+			programChip.setClockSpeed(profile.instructionsPerFrame * 60);
+		if (!quirksGiven)
+			quirks = profile.quirks;
+		memcpy(demo.keyMap, profile.keyMap, sizeof(demo.keyMap));
+	}
+	programChip.setQuirks(quirks);
+
+	if (demo.Construct(128, 64, 10, 10))
 		demo.Start();
 	return 0;
 }